@@ -0,0 +1,208 @@
+#include "handoff.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "snapshot.h"
+
+#define HANDOFF_MAGIC 0x46444e48 /* "HNDF" */
+#define HANDOFF_ACK 'A'
+#define HANDOFF_GO 'G'
+
+// Well inside the BMC's NC-SI command timeout of one second.
+static constexpr int kAckTimeoutMs = 500;
+
+struct HandoffMessage {
+  uint32_t magic;
+  uint32_t snapshot_version;
+};
+
+enum {
+  kPacketFd,
+  kStateFd,
+  kListenFd,
+  kNumFds,
+};
+
+static bool MakeAddress(const char* path, struct sockaddr_un* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "Handoff socket path is too long\n");
+    return false;
+  }
+  strcpy(addr->sun_path, path);
+  return true;
+}
+
+int ListenForSuccessor(const char* path) {
+  struct sockaddr_un addr;
+  if (!MakeAddress(path, &addr)) {
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd == -1) {
+    perror("socket");
+    return -1;
+  }
+  unlink(path);
+  if (bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0 ||
+      listen(fd, 1) != 0) {
+    perror("bind");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool HandOff(int listen_fd, int packet_fd, const Slirp& slirp) {
+  int conn = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+  if (conn == -1) {
+    return false;
+  }
+
+  int state_fd = memfd_create("ncsi-state", MFD_CLOEXEC);
+  if (state_fd == -1) {
+    perror("memfd_create");
+    close(conn);
+    return false;
+  }
+  if (!WriteSnapshot(slirp, state_fd)) {
+    close(state_fd);
+    close(conn);
+    return false;
+  }
+
+  HandoffMessage hm = {HANDOFF_MAGIC, NCSI_SNAPSHOT_VERSION};
+  int fds[kNumFds];
+  fds[kPacketFd] = packet_fd;
+  fds[kStateFd] = state_fd;
+  fds[kListenFd] = listen_fd;
+  union {
+    char buf[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = {&hm, sizeof(hm)};
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  auto c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+  bool ok = sendmsg(conn, &msg, 0) == ssize_t(sizeof(hm));
+  close(state_fd);
+  if (!ok) {
+    perror("sendmsg");
+    close(conn);
+    return false;
+  }
+
+  // An ack that arrives after the timeout is ignored, and closing the
+  // connection without a go tells the successor not to serve. Either way
+  // only one of us keeps the packet socket.
+  struct pollfd pfd = {conn, POLLIN, 0};
+  char ack = 0;
+  char go = HANDOFF_GO;
+  if (poll(&pfd, 1, kAckTimeoutMs) != 1 || read(conn, &ack, 1) != 1 ||
+      ack != HANDOFF_ACK || send(conn, &go, 1, MSG_NOSIGNAL) != 1) {
+    printf("Successor did not take over, carrying on\n");
+    close(conn);
+    return false;
+  }
+  close(conn);
+  printf("Handed off to successor\n");
+  return true;
+}
+
+int TakeOver(const char* path, Slirp* slirp, int* packet_fd, int* listen_fd) {
+  struct sockaddr_un addr;
+  if (!MakeAddress(path, &addr)) {
+    return -1;
+  }
+  int conn = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (conn == -1) {
+    perror("socket");
+    return -1;
+  }
+  if (connect(conn, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+    perror("connect");
+    close(conn);
+    return -1;
+  }
+
+  HandoffMessage hm = {};
+  int fds[kNumFds];
+  union {
+    char buf[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = {&hm, sizeof(hm)};
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  ssize_t r = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+  auto c = CMSG_FIRSTHDR(&msg);
+  if (r != ssize_t(sizeof(hm)) || !c || c->cmsg_type != SCM_RIGHTS ||
+      c->cmsg_len != CMSG_LEN(sizeof(fds))) {
+    fprintf(stderr, "Bad handoff message\n");
+    close(conn);
+    return -1;
+  }
+  memcpy(fds, CMSG_DATA(c), sizeof(fds));
+  if (hm.magic != HANDOFF_MAGIC || hm.snapshot_version != NCSI_SNAPSHOT_VERSION) {
+    fprintf(stderr, "Predecessor uses an incompatible state format\n");
+    for (int fd : fds) {
+      close(fd);
+    }
+    close(conn);
+    return -1;
+  }
+
+  bool ok = MapSnapshot(slirp, fds[kStateFd]);
+  close(fds[kStateFd]);
+  if (!ok) {
+    close(fds[kPacketFd]);
+    close(fds[kListenFd]);
+    close(conn);
+    return -1;
+  }
+  *packet_fd = fds[kPacketFd];
+  *listen_fd = fds[kListenFd];
+  return conn;
+}
+
+bool ConfirmTakeOver(int conn) {
+  char ack = HANDOFF_ACK;
+  if (send(conn, &ack, 1, MSG_NOSIGNAL) != 1) {
+    perror("send");
+    close(conn);
+    return false;
+  }
+  // The predecessor answers straight away, or closes the connection if it
+  // gave up waiting for us.
+  char go = 0;
+  ssize_t r;
+  do {
+    r = read(conn, &go, 1);
+  } while (r == -1 && errno == EINTR);
+  close(conn);
+  if (r != 1 || go != HANDOFF_GO) {
+    fprintf(stderr, "Predecessor carried on serving\n");
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <net/ethernet.h>
+
+extern "C" {
+#include "ncsi.h"
+};
+
+// Hot restart. A running emulator listens on a Unix socket; a new one
+// started with --takeover connects to it and receives the packet socket,
+// the listening socket itself and a snapshot of the state, over
+// SCM_RIGHTS. The old process stops reading as soon as it has handed the
+// socket over, so requests simply queue in the shared socket until the new
+// process picks them up, and exits once the new process confirms and it has
+// told it to go ahead. If no confirmation arrives in time it carries on
+// serving, and the new process gives up when it doesn't get the go.
+
+// Returns the listening socket, or -1.
+int ListenForSuccessor(const char* path);
+// Call when the listening socket is readable. Returns true if a successor
+// has taken over and this process should exit.
+bool HandOff(int listen_fd, int packet_fd, const Slirp& slirp);
+
+// Connects to the running emulator at `path` and takes over its packet
+// socket, listening socket and state. Returns the connection on which to
+// confirm with ConfirmTakeOver() once ready to serve, or -1.
+int TakeOver(const char* path, Slirp* slirp, int* packet_fd, int* listen_fd);
+// Returns true if the predecessor has stopped serving and this process
+// should take over, false if it must exit without touching the socket.
+bool ConfirmTakeOver(int conn);
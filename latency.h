@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+
+static inline uint64_t MonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+}
+
+// Log-linear histogram of nanosecond latencies: each power of two is split
+// into 8 linear sub-buckets, so percentiles are accurate to ~12.5%. It's a
+// flat array of counters, so recording never allocates.
+class LatencyHistogram {
+ public:
+  void Record(uint64_t ns) {
+    buckets_[Index(ns)]++;
+    if (count_ == 0 || ns < min_) {
+      min_ = ns;
+    }
+    if (ns > max_) {
+      max_ = ns;
+    }
+    count_++;
+  }
+
+  uint64_t count() const { return count_; }
+
+  // Upper bound of the bucket holding the p'th percentile, p in [0, 100].
+  uint64_t Percentile(double p) const {
+    if (count_ == 0) {
+      return 0;
+    }
+    auto rank = uint64_t(p / 100.0 * double(count_));
+    if (rank >= count_) {
+      rank = count_ - 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; i++) {
+      seen += buckets_[i];
+      if (seen > rank) {
+        uint64_t upper = UpperBound(i);
+        return upper < max_ ? upper : max_;
+      }
+    }
+    return max_;
+  }
+
+  void Print(const char* name) const {
+    printf("%s: n=%llu min=%lluns p50=%lluns p90=%lluns p99=%lluns "
+           "p99.9=%lluns max=%lluns\n",
+           name, (unsigned long long)count_, (unsigned long long)min_,
+           (unsigned long long)Percentile(50),
+           (unsigned long long)Percentile(90),
+           (unsigned long long)Percentile(99),
+           (unsigned long long)Percentile(99.9),
+           (unsigned long long)max_);
+  }
+
+ private:
+  static constexpr int kSubBits = 3;
+  static constexpr int kBuckets = (64 - kSubBits + 1) << kSubBits;
+
+  static int Index(uint64_t ns) {
+    int msb = 63 - __builtin_clzll(ns | 1);
+    if (msb < kSubBits) {
+      return int(ns);
+    }
+    int shift = msb - kSubBits;
+    int sub = int(ns >> shift) & ((1 << kSubBits) - 1);
+    return ((shift + 1) << kSubBits) + sub;
+  }
+
+  static uint64_t UpperBound(int index) {
+    if (index < (1 << kSubBits)) {
+      return uint64_t(index);
+    }
+    int shift = (index >> kSubBits) - 1;
+    uint64_t sub = uint64_t(index & ((1 << kSubBits) - 1));
+    return (((1ull << kSubBits) + sub + 1) << shift) - 1;
+  }
+
+  uint64_t buckets_[kBuckets] = {};
+  uint64_t count_ = 0;
+  uint64_t min_ = 0;
+  uint64_t max_ = 0;
+};
@@ -0,0 +1,171 @@
+#include "linkmon.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+// <net/if.h> only has the BSD flags, and <linux/if.h> clashes with it.
+#ifndef IFF_LOWER_UP
+#define IFF_LOWER_UP 0x10000
+#endif
+
+static uint32_t SpeedCode(unsigned long mbps) {
+  switch (mbps) {
+    case 10:
+      return NCSI_LINK_10_FD;
+    case 100:
+      return NCSI_LINK_100_FD;
+    case 1000:
+      return NCSI_LINK_1000_FD;
+    case 2500:
+      return NCSI_LINK_2500_FD;
+    case 10000:
+      return NCSI_LINK_10G;
+    case 20000:
+      return NCSI_LINK_20G;
+    case 25000:
+      return NCSI_LINK_25G;
+    case 40000:
+      return NCSI_LINK_40G;
+    case 50000:
+      return NCSI_LINK_50G;
+    case 100000:
+      return NCSI_LINK_100G;
+    default:
+      return 0;
+  }
+}
+
+bool LinkMonitor::Open(const char* ifname, Slirp* slirp) {
+  ifindex_ = int(if_nametoindex(ifname));
+  if (ifindex_ == 0) {
+    perror("if_nametoindex");
+    return false;
+  }
+  snprintf(ifname_, sizeof(ifname_), "%s", ifname);
+
+  int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (fd == -1) {
+    perror("socket");
+    return false;
+  }
+  struct sockaddr_nl addr = {};
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = RTMGRP_LINK;
+  if (bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+    perror("bind");
+    close(fd);
+    return false;
+  }
+
+  fd_ = fd;
+  if (!RequestLink()) {
+    close(fd);
+    fd_ = -1;
+    return false;
+  }
+
+  // Wait for the answer so we start out with the right status.
+  alignas(struct nlmsghdr) uint8_t buf[8192];
+  ssize_t r = recv(fd, buf, sizeof(buf), 0);
+  if (r < 0) {
+    perror("recv");
+  } else {
+    Apply(buf, size_t(r), slirp);
+  }
+  return true;
+}
+
+bool LinkMonitor::RequestLink() {
+  struct {
+    struct nlmsghdr nh;
+    struct ifinfomsg ifi;
+  } req = {};
+  req.nh.nlmsg_len = sizeof(req);
+  req.nh.nlmsg_type = RTM_GETLINK;
+  req.nh.nlmsg_flags = NLM_F_REQUEST;
+  req.ifi.ifi_family = AF_UNSPEC;
+  req.ifi.ifi_index = ifindex_;
+  if (send(fd_, &req, sizeof(req), 0) != ssize_t(sizeof(req))) {
+    perror("send");
+    return false;
+  }
+  return true;
+}
+
+uint32_t LinkMonitor::ReadSpeed() const {
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/class/net/%s/speed", ifname_);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return 0;
+  }
+  char buf[32] = {};
+  ssize_t r = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (r <= 0) {
+    return 0;
+  }
+  return SpeedCode(strtoul(buf, nullptr, 10));
+}
+
+void LinkMonitor::OnReadable(Slirp* slirp) {
+  alignas(struct nlmsghdr) uint8_t buf[8192];
+  for (;;) {
+    ssize_t r = recv(fd_, buf, sizeof(buf), MSG_DONTWAIT);
+    if (r < 0 && errno == ENOBUFS) {
+      // Events were lost to an overrun: ask for the current state again.
+      // The answer is read on a later pass like any other event.
+      overruns_++;
+      RequestLink();
+      continue;
+    }
+    if (r <= 0) {
+      return;
+    }
+    Apply(buf, size_t(r), slirp);
+  }
+}
+
+void LinkMonitor::Apply(const uint8_t* buf, size_t size, Slirp* slirp) {
+  auto len = int(size);
+  for (auto nh = reinterpret_cast<const struct nlmsghdr*>(buf);
+       NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+    if (nh->nlmsg_type != RTM_NEWLINK && nh->nlmsg_type != RTM_DELLINK) {
+      continue;
+    }
+    auto ifi = static_cast<const struct ifinfomsg*>(NLMSG_DATA(nh));
+    if (ifi->ifi_index != ifindex_) {
+      continue;
+    }
+    // Carrier is IFF_LOWER_UP; an administratively down interface has no
+    // link either, whatever the carrier says.
+    bool up = nh->nlmsg_type == RTM_NEWLINK && (ifi->ifi_flags & IFF_UP) &&
+              (ifi->ifi_flags & IFF_LOWER_UP);
+    uint32_t status = 0;
+    if (up) {
+      // The speed isn't part of the link message, so look it up, but only
+      // now that something has changed.
+      status = NCSI_LINK_UP | ReadSpeed() << NCSI_LINK_SPEED_SHIFT;
+    }
+    if (status != slirp->link_status) {
+      changes_++;
+      ncsi_set_link_status(slirp, status);
+    }
+  }
+}
+
+void LinkMonitor::Print() const {
+  if (fd_ == -1) {
+    return;
+  }
+  printf("link: %s changes=%llu overruns=%llu\n", ifname_,
+         (unsigned long long)changes_, (unsigned long long)overruns_);
+}
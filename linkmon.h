@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <net/ethernet.h>
+
+extern "C" {
+#include "ncsi.h"
+};
+
+// Mirrors a host interface's carrier and speed into the emulated link
+// status. It subscribes to RTNLGRP_LINK, so changes arrive as events on a
+// netlink socket in the main loop and nothing is polled; GLS keeps
+// answering from the cached status word.
+class LinkMonitor {
+ public:
+  // Subscribes to link events and seeds the status from a dump of the
+  // interface's current state.
+  bool Open(const char* ifname, Slirp* slirp);
+  int fd() const { return fd_; }
+
+  // Reads and applies all pending link events.
+  void OnReadable(Slirp* slirp);
+
+  void Print() const;
+
+ private:
+  // Asks for the interface's current state with RTM_GETLINK.
+  bool RequestLink();
+  void Apply(const uint8_t* buf, size_t len, Slirp* slirp);
+  uint32_t ReadSpeed() const;
+
+  int fd_ = -1;
+  int ifindex_ = 0;
+  char ifname_[16] = {};
+  uint64_t changes_ = 0;
+  uint64_t overruns_ = 0;
+};
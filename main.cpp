@@ -3,46 +3,355 @@
 #include <cstdint>
 #include <cstring>
 #include <cassert>
+#include <cerrno>
+#include <memory>
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <linux/if_packet.h>
+#include <linux/net_tstamp.h>
 #include <net/ethernet.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <net/if.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/uio.h>
 
 extern "C" {
 #include "ncsi.h"
 };
 
+#include "latency.h"
+#include "handoff.h"
+#include "linkmon.h"
+#include "mctp.h"
+#include "netdev.h"
+#include "profile.h"
+#include "snapshot.h"
+#include "tap.h"
+#include "timestamp.h"
+#include "txq.h"
+#include "vhostuser.h"
+#include "workers.h"
+
+static volatile sig_atomic_t g_stop;
+static volatile sig_atomic_t g_dump_stats;
+static volatile sig_atomic_t g_snapshot;
+
+// How long a process that has handed off keeps sending its TX backlog.
+static constexpr int kHandOffDrainMs = 100;
+// SO_BUSY_POLL in the low-latency mode.
+static constexpr int kBusyPollUsecs = 50;
+
+static void HandleSignal(int sig) {
+  if (sig == SIGUSR1) {
+    g_dump_stats = 1;
+  } else if (sig == SIGUSR2) {
+    g_snapshot = 1;
+  } else {
+    g_stop = 1;
+  }
+}
+
 static uint16_t Ethertype(const uint8_t* pkt, size_t len) {
   assert(len >= 14);
   auto p = reinterpret_cast<const uint16_t*>(&pkt[12]);
   return ntohs(*p);
 }
 
-int main(int argc, char** argv) {
-  if (argc < 2) {
-    printf("Usage: %s <interface name>\n", argv[0]);
-    return 1;
+struct Options {
+  const char* ifname = nullptr;
+  uint32_t mfr_id = NCSI_OEM_MFR_MLX_ID;
+  // Spin on a non-blocking socket instead of sleeping in recv(), and lock
+  // and pre-fault all memory so the hot path never takes a page fault.
+  bool low_latency = false;
+  int cpu = -1;
+  int fifo_priority = 0;
+  bool timestamps = false;
+  // Serve NC-SI over MCTP on this Unix datagram socket instead of RBT.
+  const char* mctp_path = nullptr;
+  uint8_t mctp_eid = 8;
+  size_t mctp_mtu = MctpEndpoint::kBaselineMtu;
+  // Written on SIGUSR2.
+  const char* snapshot_path = nullptr;
+  const char* restore_path = nullptr;
+  // Hot restart: hand over to a successor connecting on this socket, or
+  // take over from the emulator listening on it.
+  const char* handoff_path = nullptr;
+  const char* takeover_path = nullptr;
+  // Report this host interface's carrier and speed as our link status.
+  const char* link_from = nullptr;
+  // Run commands on this many worker threads, sharded by channel.
+  int workers = 0;
+  // Count cycles, instructions and misses per command type.
+  bool profile = false;
+  // Serve on our own multi-queue tap instead of a packet socket.
+  const char* tap_name = nullptr;
+  // Serve as QEMU's vhost-user-net backend on this Unix socket.
+  const char* vhost_user_path = nullptr;
+  // Be the peer of QEMU's -netdev stream or -netdev dgram at this address.
+  const char* stream_address = nullptr;
+  const char* dgram_address = nullptr;
+};
+
+static void Usage(const char* argv0) {
+  printf("Usage: %s [options] <interface name>\n", argv0);
+  printf("       %s [options] --mctp=PATH\n", argv0);
+  printf("       %s [options] --takeover=PATH\n", argv0);
+  printf("       %s [options] --tap=NAME\n", argv0);
+  printf("       %s [options] --vhost-user=PATH\n", argv0);
+  printf("       %s [options] --stream=ADDR | --dgram=ADDR\n", argv0);
+  printf("  -v, --vendor=NAME   emulate a mlx (default), bcm or intel controller\n");
+  printf("  -l, --low-latency   busy-poll the socket, mlockall and pre-fault\n");
+  printf("  -c, --cpu=N         pin to CPU N\n");
+  printf("  -f, --fifo=PRIO     run with SCHED_FIFO at priority PRIO\n");
+  printf("  -t, --timestamps    measure turnaround with SO_TIMESTAMPING\n");
+  printf("  -m, --mctp=PATH     serve NC-SI over MCTP on a Unix datagram socket\n");
+  printf("      --mctp-eid=EID  our MCTP endpoint ID (default 8)\n");
+  printf("      --mctp-mtu=N    MCTP transmission unit (default 64)\n");
+  printf("  -s, --snapshot=PATH write a state snapshot to PATH on SIGUSR2\n");
+  printf("  -r, --restore=PATH  start from the state snapshot in PATH\n");
+  printf("      --handoff=PATH  let a new emulator take over through PATH\n");
+  printf("      --takeover=PATH take over from the emulator at PATH\n");
+  printf("      --link-from=IF  mirror the link state of host interface IF\n");
+  printf("      --workers=N     run commands on N threads, sharded by channel\n");
+  printf("      --profile       count cycles, instructions and misses per command\n");
+  printf("      --tap=NAME      create or attach to multi-queue tap NAME and\n");
+  printf("                      serve on it, one queue per worker\n");
+  printf("      --vhost-user=PATH be QEMU's vhost-user-net backend on PATH\n");
+  printf("      --stream=ADDR   accept QEMU's -netdev stream on unix:PATH or\n");
+  printf("                      HOST:PORT\n");
+  printf("      --dgram=ADDR    serve QEMU's -netdev dgram on unix:PATH or\n");
+  printf("                      HOST:PORT\n");
+  printf("Send SIGUSR1 to print statistics.\n");
+}
+
+// Long options without a short form.
+enum {
+  kOptMctpEid = 256,
+  kOptMctpMtu,
+  kOptHandoff,
+  kOptTakeover,
+  kOptLinkFrom,
+  kOptWorkers,
+  kOptProfile,
+  kOptTap,
+  kOptVhostUser,
+  kOptStream,
+  kOptDgram,
+};
+
+static bool ParseOptions(int argc, char** argv, Options* opts) {
+  static const struct option long_options[] = {
+    {"vendor", required_argument, nullptr, 'v'},
+    {"low-latency", no_argument, nullptr, 'l'},
+    {"cpu", required_argument, nullptr, 'c'},
+    {"fifo", required_argument, nullptr, 'f'},
+    {"timestamps", no_argument, nullptr, 't'},
+    {"mctp", required_argument, nullptr, 'm'},
+    {"snapshot", required_argument, nullptr, 's'},
+    {"restore", required_argument, nullptr, 'r'},
+    {"mctp-eid", required_argument, nullptr, kOptMctpEid},
+    {"mctp-mtu", required_argument, nullptr, kOptMctpMtu},
+    {"handoff", required_argument, nullptr, kOptHandoff},
+    {"takeover", required_argument, nullptr, kOptTakeover},
+    {"link-from", required_argument, nullptr, kOptLinkFrom},
+    {"workers", required_argument, nullptr, kOptWorkers},
+    {"profile", no_argument, nullptr, kOptProfile},
+    {"tap", required_argument, nullptr, kOptTap},
+    {"vhost-user", required_argument, nullptr, kOptVhostUser},
+    {"stream", required_argument, nullptr, kOptStream},
+    {"dgram", required_argument, nullptr, kOptDgram},
+    {"help", no_argument, nullptr, 'h'},
+    {nullptr, 0, nullptr, 0},
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "v:lc:f:tm:s:r:h", long_options, nullptr)) != -1) {
+    switch (c) {
+      case 'v': {
+        auto personality = ncsi_find_personality(optarg);
+        if (!personality) {
+          printf("Unknown vendor %s\n", optarg);
+          return false;
+        }
+        opts->mfr_id = personality->mfr_id;
+        break;
+      }
+      case 'l':
+        opts->low_latency = true;
+        break;
+      case 'c':
+        opts->cpu = atoi(optarg);
+        break;
+      case 'f':
+        opts->fifo_priority = atoi(optarg);
+        break;
+      case 't':
+        opts->timestamps = true;
+        break;
+      case 'm':
+        opts->mctp_path = optarg;
+        break;
+      case 's':
+        opts->snapshot_path = optarg;
+        break;
+      case 'r':
+        opts->restore_path = optarg;
+        break;
+      case kOptMctpEid:
+        opts->mctp_eid = uint8_t(strtoul(optarg, nullptr, 0));
+        break;
+      case kOptMctpMtu:
+        opts->mctp_mtu = strtoul(optarg, nullptr, 0);
+        break;
+      case kOptHandoff:
+        opts->handoff_path = optarg;
+        break;
+      case kOptTakeover:
+        opts->takeover_path = optarg;
+        break;
+      case kOptLinkFrom:
+        opts->link_from = optarg;
+        break;
+      case kOptWorkers:
+        opts->workers = atoi(optarg);
+        break;
+      case kOptProfile:
+        opts->profile = true;
+        break;
+      case kOptTap:
+        opts->tap_name = optarg;
+        break;
+      case kOptVhostUser:
+        opts->vhost_user_path = optarg;
+        break;
+      case kOptStream:
+        opts->stream_address = optarg;
+        break;
+      case kOptDgram:
+        opts->dgram_address = optarg;
+        break;
+      default:
+        return false;
+    }
+  }
+  if (opts->mctp_path || opts->takeover_path || opts->tap_name ||
+      opts->vhost_user_path || opts->stream_address || opts->dgram_address) {
+    return optind == argc;
+  }
+  if (optind != argc - 1) {
+    return false;
+  }
+  opts->ifname = argv[optind];
+  return true;
+}
+
+// Touch enough stack that ncsi_input() and everything below it runs on
+// pages that are already mapped (and, after mlockall, locked).
+static void __attribute__((noinline)) PrefaultStack() {
+  volatile uint8_t stack[256 * 1024];
+  for (size_t i = 0; i < sizeof(stack); i += 4096) {
+    stack[i] = 0;
+  }
+}
+
+// Acts on the signals that arrived since the last call.
+template <typename PrintStats>
+static void HandlePendingSignals(const Options& opts, const Slirp& slirp,
+                                 PrintStats print_stats) {
+  if (g_dump_stats) {
+    g_dump_stats = 0;
+    print_stats();
+  }
+  if (g_snapshot) {
+    g_snapshot = 0;
+    if (!opts.snapshot_path) {
+      printf("No snapshot path given, ignoring SIGUSR2\n");
+    } else if (SaveSnapshot(slirp, opts.snapshot_path)) {
+      printf("Saved snapshot to %s\n", opts.snapshot_path);
+    }
+  }
+}
+
+// The low-latency options for the socket we serve on.
+static bool SetupLowLatencySocket(const Options& opts, int fd) {
+  if (!opts.low_latency) {
+    return true;
   }
-  const char* ifname = argv[1];
+  // Busy polling only helps devices with NAPI, which a tap usually
+  // doesn't have, so these are best-effort: the spin loop below is what
+  // actually avoids the sleep.
+  int busy_poll_usecs = kBusyPollUsecs;
+  setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_usecs,
+             sizeof(busy_poll_usecs));
+#ifdef SO_PREFER_BUSY_POLL
+  int prefer = 1;
+  setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+#endif
+
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+    perror("fcntl");
+    return false;
+  }
+  return true;
+}
+
+// Sets up the process and, unless `fd` is -1, the socket we serve on.
+// `mlock_flags` go to mlockall(): without MCL_FUTURE, only what is mapped
+// now is locked, not what gets mapped later.
+static bool SetupLowLatency(const Options& opts, int fd,
+                            int mlock_flags = MCL_CURRENT | MCL_FUTURE) {
+  if (opts.cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(opts.cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+      perror("sched_setaffinity");
+      return false;
+    }
+  }
+  if (opts.fifo_priority > 0) {
+    struct sched_param param = {};
+    param.sched_priority = opts.fifo_priority;
+    if (sched_setscheduler(0, SCHED_FIFO, &param) != 0) {
+      perror("sched_setscheduler");
+      return false;
+    }
+  }
+  if (!opts.low_latency) {
+    return true;
+  }
+  if (fd != -1 && !SetupLowLatencySocket(opts, fd)) {
+    return false;
+  }
+  if (mlockall(mlock_flags) != 0) {
+    perror("mlockall");
+    return false;
+  }
+  PrefaultStack();
+  return true;
+}
+
+static int OpenPacketSocket(const char* ifname) {
   int ifindex = if_nametoindex(ifname);
   if (ifindex == 0) {
     perror("if_nametoindex");
-    return 1;
+    return -1;
   }
 
   int fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
   if (fd == -1) {
     perror("socket");
-    return 1;
+    return -1;
   }
   if (fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) {
     perror("fcntl");
     close(fd);
-    return 1;
+    return -1;
   }
 
   struct sockaddr_ll sll = {
@@ -53,24 +362,190 @@ int main(int argc, char** argv) {
   };
   if (bind(fd, reinterpret_cast<const sockaddr*>(&sll), sizeof(sll)) != 0) {
     perror("bind");
-    return 1;
+    close(fd);
+    return -1;
   }
+  return fd;
+}
 
-  auto slirp = Slirp {
-    .mfr_id = 0x8119,
-    .ncsi_mac = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF},
-    .socket = fd,
+static int RunPacketSocket(const Options& opts, Slirp* slirp) {
+  int fd = -1;
+  int listen_fd = -1;
+  int takeover_conn = -1;
+  if (opts.takeover_path) {
+    takeover_conn = TakeOver(opts.takeover_path, slirp, &fd, &listen_fd);
+    if (takeover_conn == -1) {
+      return 1;
+    }
+    if (!opts.handoff_path) {
+      close(listen_fd);
+      listen_fd = -1;
+    }
+  } else {
+    fd = OpenPacketSocket(opts.ifname);
+    if (fd == -1) {
+      return 1;
+    }
+  }
+  if (opts.handoff_path && listen_fd == -1) {
+    listen_fd = ListenForSuccessor(opts.handoff_path);
+    if (listen_fd == -1) {
+      return 1;
+    }
+  }
+
+  // Large, so keep it off the stack.
+  static TxQueue txq(fd);
+  slirp->send_packet = TxQueue::SendPacket;
+  slirp->opaque = &txq;
+
+  // Opened once we are serving: a link change raises AENs on the socket.
+  LinkMonitor link;
+
+  uint8_t pkt[64];
+  uint8_t control[256];
+  LatencyHistogram wake_to_reply;
+  static TurnaroundTracker turnaround;
+  // The predecessor serves on the same socket until it has told us to go
+  // ahead, so until then we mustn't change any of its settings.
+  if (!SetupLowLatency(opts, takeover_conn == -1 ? fd : -1)) {
+    return 1;
+  }
+  if (takeover_conn == -1 && opts.timestamps && !turnaround.Enable(fd)) {
+    return 1;
+  }
+  // Started after SetupLowLatency() so the workers inherit its scheduling
+  // policy and locked memory; they get the CPUs after the main loop's.
+  static WorkerPool pool;
+  if (opts.workers > 0 &&
+      !pool.Start(slirp, opts.workers, opts.cpu >= 0 ? opts.cpu + 1 : -1,
+                  opts.low_latency)) {
+    return 1;
+  }
+  const char* mode = opts.low_latency ? "busy-poll" : "blocking";
+  auto print_stats = [&]() {
+    wake_to_reply.Print(mode);
+    turnaround.Print();
+    txq.Print();
+    link.Print();
+    pool.Print();
+    PrintHandlerProfile();
   };
+  if (takeover_conn != -1) {
+    if (!ConfirmTakeOver(takeover_conn)) {
+      pool.Stop();
+      return 1;
+    }
+    printf("Took over from predecessor\n");
+    // The socket keeps whatever options the predecessor set on it.
+    if (!opts.timestamps) {
+      unsigned int flags = 0;
+      setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+    }
+    if (!SetupLowLatencySocket(opts, fd) ||
+        (opts.timestamps && !turnaround.Enable(fd))) {
+      pool.Stop();
+      return 1;
+    }
+  }
+  if (opts.link_from && !link.Open(opts.link_from, slirp)) {
+    pool.Stop();
+    return 1;
+  }
+  // In the low-latency mode, only look for a successor or link events
+  // every so often rather than on every spin.
+  unsigned int spins = 0;
 
-  for (;;) {
-    uint8_t pkt[64];
-    ssize_t r = recv(fd, &pkt, sizeof(pkt), 0);
+  while (!g_stop) {
+    if (g_snapshot) {
+      pool.Quiesce(&txq, &wake_to_reply);
+    }
+    HandlePendingSignals(opts, *slirp, print_stats);
+    if (txq.pending()) {
+      txq.Flush();
+    }
+    // Only sleep in the default mode; the low-latency mode spins on recv.
+    bool successor = false;
+    if (!opts.low_latency) {
+      // poll() skips entries with a negative fd.
+      struct pollfd pfds[] = {
+        {fd, short(POLLIN | txq.poll_events()), 0},
+        {listen_fd, POLLIN, 0},
+        {link.fd(), POLLIN, 0},
+        {pool.fd(), POLLIN, 0},
+      };
+      if (poll(pfds, 4, txq.poll_timeout_ms()) <= 0) {
+        continue;
+      }
+      if (pfds[2].revents & POLLIN) {
+        link.OnReadable(slirp);
+      }
+      if (pfds[3].revents & POLLIN) {
+        pool.Collect(&txq, &wake_to_reply);
+        turnaround.DrainErrorQueue();
+      }
+      // A TX timestamp that comes in after the reply was sent.
+      if (pfds[0].revents & POLLERR) {
+        if (turnaround.enabled()) {
+          turnaround.DrainErrorQueue();
+        } else {
+          DiscardErrorQueue(fd);
+        }
+      }
+      successor = pfds[1].revents & POLLIN;
+      if (!(pfds[0].revents & POLLIN) && !successor) {
+        continue;
+      }
+    } else {
+      if (pool.enabled()) {
+        pool.Collect(&txq, &wake_to_reply);
+        turnaround.DrainErrorQueue();
+      }
+      if (++spins % 4096 == 0) {
+        if (link.fd() != -1) {
+          link.OnReadable(slirp);
+        }
+        // Only stop the workers and flush for a successor that is there.
+        if (listen_fd != -1) {
+          struct pollfd pfd = {listen_fd, POLLIN, 0};
+          successor = poll(&pfd, 1, 0) == 1;
+        }
+      }
+    }
+    if (successor) {
+      pool.Quiesce(&txq, &wake_to_reply);
+      txq.Flush();
+      if (HandOff(listen_fd, fd, *slirp)) {
+        // The successor shares the socket, so what is still queued can go
+        // out after it has taken over.
+        txq.Drain(kHandOffDrainMs);
+        if (txq.pending()) {
+          printf("Handed off with %zu replies unsent\n", txq.backlog());
+        }
+        print_stats();
+        pool.Stop();
+        return 0;
+      }
+      continue;
+    }
+    struct iovec iov = {pkt, sizeof(pkt)};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t r = recvmsg(fd, &msg, MSG_DONTWAIT);
     switch (r) {
       case -1:
+        if (errno == EAGAIN || errno == EINTR) {
+          continue;
+        }
+        [[fallthrough]];
       case 0:
         perror("recv");
         continue;
     }
+    uint64_t wake = MonotonicNanos();
     size_t len = size_t(r);
     if (len < ETH_HLEN) {
       printf("Packet is too small to have an ethernet header\n");
@@ -79,10 +554,377 @@ int main(int argc, char** argv) {
     if (Ethertype(pkt, len) != ETH_P_NCSI) {
       continue;
     }
-    ncsi_input(&slirp, pkt, int(len));
+    if (turnaround.enabled()) {
+      turnaround.OnReceive(&msg, pkt, len, wake);
+    }
+    if (pool.enabled()) {
+      pool.Dispatch(pkt, len, wake);
+      continue;
+    }
+    ncsi_input(slirp, pkt, int(len));
+    wake_to_reply.Record(MonotonicNanos() - wake);
+    turnaround.DrainErrorQueue();
+  }
+  pool.Quiesce(&txq, &wake_to_reply);
+  print_stats();
+  pool.Stop();
+  return 0;
+}
+
+static int RunTap(const Options& opts, Slirp* slirp) {
+  if (opts.timestamps || opts.handoff_path || opts.takeover_path) {
+    fprintf(stderr, "--timestamps, --handoff and --takeover need a packet "
+            "socket\n");
+    return 1;
+  }
+  // Queue 0 is the main loop's: it reads every queue and sends AENs and,
+  // without workers, the replies. Each worker sends on a queue of its own.
+  static TapDevice tap;
+  if (!tap.Open(opts.tap_name, 1 + opts.workers)) {
+    return 1;
+  }
+  if (!SetupLowLatency(opts, tap.fd(0))) {
+    return 1;
+  }
+  static TxQueue txq(tap.fd(0), TapDevice::kVnetHdrLen);
+  slirp->send_packet = TxQueue::SendPacket;
+  slirp->opaque = &txq;
+
+  LinkMonitor link;
+  if (opts.link_from && !link.Open(opts.link_from, slirp)) {
+    return 1;
+  }
+  std::unique_ptr<TxQueue> worker_txqs[TapDevice::kMaxQueues];
+  TxQueue* worker_txq_ptrs[TapDevice::kMaxQueues];
+  for (int i = 0; i < opts.workers; i++) {
+    worker_txqs[i].reset(new TxQueue(tap.fd(1 + i), TapDevice::kVnetHdrLen));
+    worker_txq_ptrs[i] = worker_txqs[i].get();
+  }
+  static WorkerPool pool;
+  if (opts.workers > 0 &&
+      !pool.Start(slirp, opts.workers, opts.cpu >= 0 ? opts.cpu + 1 : -1,
+                  opts.low_latency, worker_txq_ptrs)) {
+    return 1;
+  }
+
+  uint8_t vnet_hdr[TapDevice::kVnetHdrLen];
+  uint8_t pkt[64];
+  LatencyHistogram wake_to_reply;
+  const char* mode = opts.low_latency ? "tap-busy-poll" : "tap-blocking";
+  auto print_stats = [&]() {
+    // With workers, they time their own replies.
+    if (!pool.enabled()) {
+      wake_to_reply.Print(mode);
+    }
+    txq.Print();
+    link.Print();
+    pool.Print();
+    PrintHandlerProfile();
+  };
+  unsigned int spins = 0;
+
+  while (!g_stop) {
+    if (g_snapshot) {
+      pool.Quiesce(&txq, &wake_to_reply);
+    }
+    HandlePendingSignals(opts, *slirp, print_stats);
+    if (txq.pending()) {
+      txq.Flush();
+    }
+    if (!opts.low_latency) {
+      struct pollfd pfds[TapDevice::kMaxQueues + 2];
+      int nfds = tap.queues();
+      for (int i = 0; i < nfds; i++) {
+        pfds[i] = {tap.fd(i), POLLIN, 0};
+      }
+      pfds[0].events |= txq.poll_events();
+      pfds[nfds++] = {link.fd(), POLLIN, 0};
+      pfds[nfds++] = {pool.fd(), POLLIN, 0};
+      if (poll(pfds, nfds, txq.poll_timeout_ms()) <= 0) {
+        continue;
+      }
+      if (pfds[nfds - 2].revents & POLLIN) {
+        link.OnReadable(slirp);
+      }
+      // A worker's command made an AEN sendable; this also flushes it.
+      if (pfds[nfds - 1].revents & POLLIN) {
+        pool.Collect(&txq, &wake_to_reply);
+      }
+    } else if (++spins % 4096 == 0 && link.fd() != -1) {
+      link.OnReadable(slirp);
+    }
+
+    // The kernel spreads frames over the queues, so read them all.
+    for (int q = 0; q < tap.queues(); q++) {
+      for (;;) {
+        struct iovec iov[2] = {
+          {vnet_hdr, sizeof(vnet_hdr)},
+          {pkt, sizeof(pkt)},
+        };
+        ssize_t r = readv(tap.fd(q), iov, 2);
+        if (r < 0) {
+          if (errno != EAGAIN && errno != EINTR) {
+            perror("read");
+          }
+          break;
+        }
+        uint64_t wake = MonotonicNanos();
+        if (size_t(r) < sizeof(vnet_hdr) + ETH_HLEN) {
+          continue;
+        }
+        size_t len = size_t(r) - sizeof(vnet_hdr);
+        if (len > sizeof(pkt)) {
+          len = sizeof(pkt);
+        }
+        if (Ethertype(pkt, len) != ETH_P_NCSI) {
+          continue;
+        }
+        if (pool.enabled()) {
+          pool.Dispatch(pkt, len, wake);
+          continue;
+        }
+        ncsi_input(slirp, pkt, int(len));
+        wake_to_reply.Record(MonotonicNanos() - wake);
+      }
+    }
+    // Workers send their own replies, but AENs go out from here.
+    if (pool.enabled()) {
+      ncsi_aen_flush(slirp);
+    }
+  }
+  pool.Quiesce(&txq, &wake_to_reply);
+  print_stats();
+  pool.Stop();
+  return 0;
+}
+
+static int RunVhostUser(const Options& opts, Slirp* slirp) {
+  if (opts.timestamps || opts.handoff_path || opts.takeover_path ||
+      opts.workers > 0) {
+    fprintf(stderr, "--timestamps, --handoff, --takeover and --workers "
+            "don't work with --vhost-user\n");
+    return 1;
+  }
+  static VhostUserBackend vu;
+  if (!vu.Listen(opts.vhost_user_path)) {
+    return 1;
+  }
+  // Everything on our hot path is allocated by now. Locking future
+  // mappings too would lock the guest's RAM when QEMU shares it with us:
+  // without root, the mmap() fails beyond RLIMIT_MEMLOCK, and with it, all
+  // of guest memory is pinned.
+  if (!SetupLowLatency(opts, vu.listen_fd(), MCL_CURRENT)) {
+    return 1;
+  }
+  slirp->send_packet = VhostUserBackend::SendPacket;
+  slirp->opaque = &vu;
+
+  LinkMonitor link;
+  if (opts.link_from && !link.Open(opts.link_from, slirp)) {
+    return 1;
+  }
+  LatencyHistogram wake_to_reply;
+  const char* mode = opts.low_latency ? "vhost-user-busy-poll"
+                                      : "vhost-user-blocking";
+  auto print_stats = [&]() {
+    wake_to_reply.Print(mode);
+    vu.Print();
+    link.Print();
+    PrintHandlerProfile();
+  };
+  // In the low-latency mode, only look at the sockets every so often and
+  // otherwise spin on the ring.
+  unsigned int spins = 0;
+
+  while (!g_stop) {
+    HandlePendingSignals(opts, *slirp, print_stats);
+    if (opts.low_latency) {
+      vu.ProcessTx(slirp, true, &wake_to_reply);
+      if (++spins % 4096 != 0) {
+        continue;
+      }
+    }
+    struct pollfd pfds[] = {
+      {vu.listen_fd(), POLLIN, 0},
+      {vu.conn_fd(), POLLIN, 0},
+      {link.fd(), POLLIN, 0},
+      {opts.low_latency ? -1 : vu.kick_fd(), POLLIN, 0},
+    };
+    if (poll(pfds, 4, opts.low_latency ? 0 : -1) <= 0) {
+      continue;
+    }
+    if (pfds[0].revents & POLLIN) {
+      vu.Accept();
+    }
+    // Also sees the hang-up.
+    if (pfds[1].revents) {
+      vu.OnControlReadable();
+    }
+    if (pfds[2].revents & POLLIN) {
+      link.OnReadable(slirp);
+    }
+    if (pfds[3].revents & POLLIN) {
+      vu.ProcessTx(slirp, false, &wake_to_reply);
+    }
+  }
+  print_stats();
+  return 0;
+}
+
+// Serves on a StreamNetdev or DgramNetdev that is already listening.
+template <typename Netdev>
+static int RunSocketNetdev(const Options& opts, Slirp* slirp, Netdev* netdev,
+                           const char* mode) {
+  if (opts.timestamps || opts.handoff_path || opts.takeover_path ||
+      opts.workers > 0) {
+    fprintf(stderr, "--timestamps, --handoff, --takeover and --workers "
+            "don't work with --stream or --dgram\n");
+    return 1;
+  }
+  if (!SetupLowLatency(opts, netdev->fd() != -1 ? netdev->fd()
+                                                : netdev->listen_fd())) {
+    return 1;
+  }
+  slirp->send_packet = Netdev::SendPacket;
+  slirp->opaque = netdev;
 
-    // if (send(fd, &response, sizeof(response), 0) != ssize_t(sizeof(response))) {
-    //   perror("send");
-    // }
+  LinkMonitor link;
+  if (opts.link_from && !link.Open(opts.link_from, slirp)) {
+    return 1;
+  }
+  LatencyHistogram wake_to_reply;
+  auto print_stats = [&]() {
+    wake_to_reply.Print(mode);
+    netdev->Print();
+    link.Print();
+    PrintHandlerProfile();
+  };
+  unsigned int spins = 0;
+
+  while (!g_stop) {
+    HandlePendingSignals(opts, *slirp, print_stats);
+    if (opts.low_latency) {
+      // The sockets are non-blocking: just keep reading.
+      netdev->OnReadable(slirp, &wake_to_reply);
+      if (++spins % 4096 != 0) {
+        continue;
+      }
+    }
+    struct pollfd pfds[] = {
+      {netdev->listen_fd(), POLLIN, 0},
+      {opts.low_latency ? -1 : netdev->fd(),
+       short(POLLIN | netdev->poll_events()), 0},
+      {link.fd(), POLLIN, 0},
+    };
+    if (poll(pfds, 3, opts.low_latency ? 0 : -1) <= 0) {
+      continue;
+    }
+    if (pfds[0].revents & POLLIN) {
+      netdev->Accept();
+    }
+    if (pfds[1].revents & POLLOUT) {
+      netdev->OnWritable();
+    }
+    // Also sees the hang-up.
+    if (pfds[1].revents & ~POLLOUT) {
+      netdev->OnReadable(slirp, &wake_to_reply);
+    }
+    if (pfds[2].revents & POLLIN) {
+      link.OnReadable(slirp);
+    }
+  }
+  print_stats();
+  return 0;
+}
+
+static int RunMctp(const Options& opts, Slirp* slirp) {
+  if (opts.timestamps || opts.handoff_path || opts.takeover_path ||
+      opts.workers > 0 || opts.link_from) {
+    fprintf(stderr, "--timestamps, --handoff, --takeover, --workers and "
+            "--link-from don't work with --mctp\n");
+    return 1;
+  }
+  MctpEndpoint mctp;
+  if (!mctp.Open(opts.mctp_path, opts.mctp_eid, opts.mctp_mtu)) {
+    return 1;
+  }
+  if (!SetupLowLatency(opts, mctp.fd())) {
+    return 1;
+  }
+
+  const char* mode = opts.low_latency ? "mctp-busy-poll" : "mctp-blocking";
+  auto print_stats = [&]() {
+    mctp.Print(mode);
+    PrintHandlerProfile();
+  };
+  while (!g_stop) {
+    HandlePendingSignals(opts, *slirp, print_stats);
+    mctp.Receive(slirp);
+  }
+  print_stats();
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  Options opts;
+  if (!ParseOptions(argc, argv, &opts)) {
+    Usage(argv[0]);
+    return 1;
+  }
+
+  static struct ncsi_state state;
+  auto slirp = Slirp {
+    .ncsi_mac = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF},
+    .link_status = NCSI_LINK_UP,
+    .state = &state,
+  };
+  ncsi_set_mfr_id(&slirp, opts.mfr_id);
+  if (opts.restore_path) {
+    if (!RestoreSnapshot(&slirp, opts.restore_path)) {
+      return 1;
+    }
+    printf("Restored snapshot from %s\n", opts.restore_path);
+  }
+  if (opts.profile && !EnableHandlerProfiling(&slirp)) {
+    return 1;
+  }
+
+  // No SA_RESTART: a signal has to interrupt a blocking poll() or recv() so
+  // the loop can notice it.
+  struct sigaction sa = {};
+  sa.sa_handler = HandleSignal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+  sigaction(SIGUSR1, &sa, nullptr);
+  sigaction(SIGUSR2, &sa, nullptr);
+
+  if (opts.mctp_path) {
+    return RunMctp(opts, &slirp);
+  }
+  if (opts.tap_name) {
+    return RunTap(opts, &slirp);
+  }
+  if (opts.vhost_user_path) {
+    return RunVhostUser(opts, &slirp);
+  }
+  // Large buffers, so keep them off the stack.
+  if (opts.stream_address) {
+    static StreamNetdev stream;
+    if (!stream.Listen(opts.stream_address,
+                       opts.low_latency ? kBusyPollUsecs : 0)) {
+      return 1;
+    }
+    const char* mode = opts.low_latency ? "stream-busy-poll" : "stream-blocking";
+    return RunSocketNetdev(opts, &slirp, &stream, mode);
+  }
+  if (opts.dgram_address) {
+    static DgramNetdev dgram;
+    if (!dgram.Bind(opts.dgram_address)) {
+      return 1;
+    }
+    const char* mode = opts.low_latency ? "dgram-busy-poll" : "dgram-blocking";
+    return RunSocketNetdev(opts, &slirp, &dgram, mode);
   }
+  return RunPacketSocket(opts, &slirp);
 }
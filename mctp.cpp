@@ -0,0 +1,189 @@
+#include "mctp.h"
+
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+#define MCTP_HDR_VERSION 0x01
+#define MCTP_HDR_SOM 0x80
+#define MCTP_HDR_EOM 0x40
+#define MCTP_HDR_SEQ_SHIFT 4
+#define MCTP_HDR_SEQ_MASK 0x3
+#define MCTP_HDR_TO 0x08
+#define MCTP_HDR_TAG_MASK 0x7
+
+struct MctpHeader {
+  uint8_t version;
+  uint8_t dest_eid;
+  uint8_t src_eid;
+  uint8_t flags;
+} __attribute__((packed));
+
+bool MctpEndpoint::Open(const char* path, uint8_t eid, size_t mtu) {
+  if (mtu < kBaselineMtu || mtu > kMaxMtu) {
+    fprintf(stderr, "MCTP MTU must be between %zu and %zu\n", kBaselineMtu,
+            kMaxMtu);
+    return false;
+  }
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "MCTP socket path is too long\n");
+    return false;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    perror("socket");
+    return false;
+  }
+  unlink(path);
+  if (bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+    perror("bind");
+    close(fd);
+    return false;
+  }
+  fd_ = fd;
+  eid_ = eid;
+  mtu_ = mtu;
+  return true;
+}
+
+bool MctpEndpoint::Receive(Slirp* slirp) {
+  struct sockaddr_un peer;
+  socklen_t peer_len = sizeof(peer);
+  // MSG_TRUNC returns the real length, so oversized packets are dropped
+  // rather than reassembled truncated.
+  ssize_t r = recvfrom(fd_, rx_packet_, sizeof(rx_packet_), MSG_TRUNC,
+                       reinterpret_cast<sockaddr*>(&peer), &peer_len);
+  if (r < 0) {
+    return false;
+  }
+  uint64_t wake = MonotonicNanos();
+  size_t len = size_t(r);
+  if (len <= sizeof(MctpHeader) || len > sizeof(rx_packet_)) {
+    dropped_packets_++;
+    return false;
+  }
+  auto hdr = reinterpret_cast<const MctpHeader*>(rx_packet_);
+  const uint8_t* payload = rx_packet_ + sizeof(MctpHeader);
+  size_t payload_len = len - sizeof(MctpHeader);
+  if ((hdr->version & 0xf) != MCTP_HDR_VERSION ||
+      (hdr->dest_eid != eid_ && hdr->dest_eid != 0) ||
+      !(hdr->flags & MCTP_HDR_TO)) {
+    dropped_packets_++;
+    return false;
+  }
+
+  uint8_t tag = hdr->flags & MCTP_HDR_TAG_MASK;
+  uint8_t seq = (hdr->flags >> MCTP_HDR_SEQ_SHIFT) & MCTP_HDR_SEQ_MASK;
+  bool som = hdr->flags & MCTP_HDR_SOM;
+  bool eom = hdr->flags & MCTP_HDR_EOM;
+
+  // Almost every NC-SI command fits in one packet: handle those in place.
+  if (som && eom) {
+    reassembly_[tag].active = false;
+    HandleMessage(slirp, payload, payload_len, hdr->src_eid, tag, peer,
+                  peer_len, wake);
+    return true;
+  }
+
+  auto& ctx = reassembly_[tag];
+  if (som) {
+    if (ctx.active) {
+      dropped_messages_++;
+    }
+    ctx.active = true;
+    ctx.src_eid = hdr->src_eid;
+    ctx.len = 0;
+  } else if (!ctx.active || ctx.src_eid != hdr->src_eid ||
+             ctx.next_seq != seq) {
+    // A lost or reordered packet invalidates the whole message.
+    if (ctx.active) {
+      dropped_messages_++;
+    }
+    ctx.active = false;
+    dropped_packets_++;
+    return false;
+  }
+  // The sender's MTU may differ from ours, but every binding carries at
+  // least the baseline in each packet but the last.
+  if ((!eom && payload_len < kBaselineMtu) ||
+      ctx.len + payload_len > kMaxMessage) {
+    ctx.active = false;
+    dropped_messages_++;
+    return false;
+  }
+  memcpy(ctx.buf + ctx.len, payload, payload_len);
+  ctx.len += payload_len;
+  ctx.next_seq = (seq + 1) & MCTP_HDR_SEQ_MASK;
+  if (!eom) {
+    return false;
+  }
+  ctx.active = false;
+  HandleMessage(slirp, ctx.buf, ctx.len, ctx.src_eid, tag, peer, peer_len,
+                wake);
+  return true;
+}
+
+void MctpEndpoint::HandleMessage(Slirp* slirp, const uint8_t* msg, size_t len,
+                                 uint8_t dest_eid, uint8_t tag,
+                                 const struct sockaddr_un& peer,
+                                 socklen_t peer_len, uint64_t wake_ns) {
+  // The integrity check bit must be clear for NC-SI.
+  if (msg[0] != MCTP_MSG_TYPE_NCSI) {
+    dropped_messages_++;
+    return;
+  }
+  rx_messages_++;
+  int rsp_len = ncsi_process(slirp, msg + 1, int(len - 1), response_ + 1);
+  if (rsp_len < 0) {
+    dropped_messages_++;
+    return;
+  }
+  response_[0] = MCTP_MSG_TYPE_NCSI;
+  size_t total = 1 + size_t(rsp_len);
+
+  MctpHeader hdr = {MCTP_HDR_VERSION, dest_eid, eid_, 0};
+  struct iovec iov[2] = {
+    {&hdr, sizeof(hdr)},
+    {nullptr, 0},
+  };
+  struct msghdr mh = {};
+  mh.msg_name = const_cast<struct sockaddr_un*>(&peer);
+  mh.msg_namelen = peer_len;
+  mh.msg_iov = iov;
+  mh.msg_iovlen = 2;
+
+  uint8_t seq = 0;
+  for (size_t off = 0; off < total; off += mtu_) {
+    size_t chunk = total - off < mtu_ ? total - off : mtu_;
+    hdr.flags = uint8_t(tag | seq << MCTP_HDR_SEQ_SHIFT);
+    if (off == 0) {
+      hdr.flags |= MCTP_HDR_SOM;
+    }
+    if (off + chunk == total) {
+      hdr.flags |= MCTP_HDR_EOM;
+    }
+    iov[1].iov_base = response_ + off;
+    iov[1].iov_len = chunk;
+    if (sendmsg(fd_, &mh, 0) != ssize_t(sizeof(hdr) + chunk)) {
+      perror("sendmsg");
+      return;
+    }
+    tx_packets_++;
+    seq = (seq + 1) & MCTP_HDR_SEQ_MASK;
+  }
+  tx_messages_++;
+  wake_to_reply_.Record(MonotonicNanos() - wake_ns);
+}
+
+void MctpEndpoint::Print(const char* mode) const {
+  wake_to_reply_.Print(mode);
+  printf("mctp: rx_messages=%llu tx_messages=%llu tx_packets=%llu "
+         "dropped_packets=%llu dropped_messages=%llu\n",
+         (unsigned long long)rx_messages_, (unsigned long long)tx_messages_,
+         (unsigned long long)tx_packets_, (unsigned long long)dropped_packets_,
+         (unsigned long long)dropped_messages_);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <net/ethernet.h>
+
+extern "C" {
+#include "ncsi.h"
+};
+
+#include "latency.h"
+
+// MCTP message type for NC-SI control packets (DSP0261).
+#define MCTP_MSG_TYPE_NCSI 0x02
+
+// NC-SI over MCTP on a Unix datagram socket. Each datagram carries one
+// MCTP packet: the 4-byte transport header followed by at most `mtu`
+// bytes of message. Requests are reassembled into per-tag buffers that
+// are allocated up front, and responses are fragmented straight out of
+// the response buffer with sendmsg(), so neither direction allocates.
+class MctpEndpoint {
+ public:
+  // The smallest MTU every MCTP binding has to support.
+  static constexpr size_t kBaselineMtu = 64;
+
+  bool Open(const char* path, uint8_t eid, size_t mtu);
+  int fd() const { return fd_; }
+
+  // Reads one packet from the socket. Returns true if it completed a
+  // request, which has then been handled and answered.
+  bool Receive(Slirp* slirp);
+
+  void Print(const char* mode) const;
+
+ private:
+  static constexpr size_t kMaxMtu = 1024;
+  static constexpr size_t kMaxMessage = 1 + NCSI_MAX_LEN + 1024;
+  static constexpr int kTags = 8;
+
+  struct Reassembly {
+    bool active;
+    uint8_t src_eid;
+    uint8_t next_seq;
+    size_t len;
+    uint8_t buf[kMaxMessage];
+  };
+
+  void HandleMessage(Slirp* slirp, const uint8_t* msg, size_t len,
+                     uint8_t dest_eid, uint8_t tag,
+                     const struct sockaddr_un& peer, socklen_t peer_len,
+                     uint64_t wake_ns);
+
+  int fd_ = -1;
+  uint8_t eid_ = 0;
+  size_t mtu_ = kBaselineMtu;
+  Reassembly reassembly_[kTags] = {};
+  uint8_t rx_packet_[4 + kMaxMtu];
+  uint8_t response_[1 + NCSI_MAX_LEN];
+
+  // From reading the last packet of a request to sending the last packet
+  // of its response.
+  LatencyHistogram wake_to_reply_;
+  uint64_t rx_messages_ = 0;
+  uint64_t tx_messages_ = 0;
+  uint64_t tx_packets_ = 0;
+  uint64_t dropped_packets_ = 0;
+  uint64_t dropped_messages_ = 0;
+};
@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * NC-SI Broadcom personality
+ */
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include "ncsi.h"
+
+/* Response handler for Broadcom command Get Mac Address */
+static int ncsi_rsp_handler_oem_bcm_gma(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                                        struct ncsi_rsp_pkt_hdr *rnh)
+{
+    struct ncsi_rsp_oem_pkt *rsp = (struct ncsi_rsp_oem_pkt *)rnh;
+
+    /* code/reason, mfr_id and the MAC, padded to 4 bytes */
+    rnh->common.length = htons(44);
+    memcpy(&rsp->data[BCM_MAC_ADDR_OFFSET], slirp->ncsi_mac, ETH_ALEN);
+
+    return 0;
+}
+
+static const struct ncsi_oem_handler ncsi_rsp_oem_bcm_handlers[256] = {
+    [NCSI_OEM_BCM_CMD_GMA] = { 8, ncsi_rsp_handler_oem_bcm_gma },
+};
+
+/* Response handler for Broadcom card */
+static int ncsi_rsp_handler_oem_bcm(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                                    struct ncsi_rsp_pkt_hdr *rnh)
+{
+    const struct ncsi_cmd_oem_pkt *cmd = (const struct ncsi_cmd_oem_pkt *)nh;
+    const struct ncsi_cmd_oem_bcm_pkt *bcm_cmd =
+        (const struct ncsi_cmd_oem_bcm_pkt *)cmd->data;
+    struct ncsi_rsp_oem_pkt *rsp = (struct ncsi_rsp_oem_pkt *)rnh;
+    struct ncsi_rsp_oem_bcm_pkt *bcm_rsp =
+        (struct ncsi_rsp_oem_bcm_pkt *)rsp->data;
+    const struct ncsi_oem_handler *handler;
+
+    if (ntohs(nh->length) < 4 + sizeof(*bcm_cmd)) {
+        return ncsi_rsp_length_error(rnh);
+    }
+    bcm_rsp->ver = bcm_cmd->ver;
+    bcm_rsp->type = bcm_cmd->type;
+    bcm_rsp->len = bcm_cmd->len;
+
+    handler = &ncsi_rsp_oem_bcm_handlers[bcm_cmd->type];
+    if (!handler->handler) {
+        return 0;
+    }
+    if (ntohs(nh->length) < handler->cmd_payload) {
+        return ncsi_rsp_length_error(rnh);
+    }
+    return handler->handler(slirp, nh, rnh);
+}
+
+const struct ncsi_personality ncsi_personality_bcm = {
+    .mfr_id = NCSI_OEM_MFR_BCM_ID,
+    .name = "bcm",
+    .fw_name = "bcm0.1",
+    .fw_version = 0x00010000,
+    .pci_ids = { 0x16d7, 0x14e4, 0x0001, 0x14e4 }, /* BCM57414 */
+    .cap = ~0,
+    .bc_cap = ~0,
+    .mc_cap = ~0,
+    .buf_cap = ~0,
+    .aen_cap = ~0,
+    .vlan_mode = 0xff,
+    .uc_cnt = NCSI_MAX_MAC_FILTERS,
+    .oem_handler = ncsi_rsp_handler_oem_bcm,
+};
@@ -0,0 +1,86 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * NC-SI Intel personality
+ */
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include "ncsi.h"
+
+/* Response handler for Intel command Get Mac Address */
+static int ncsi_rsp_handler_oem_intel_gma(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                                          struct ncsi_rsp_pkt_hdr *rnh)
+{
+    struct ncsi_rsp_oem_pkt *rsp = (struct ncsi_rsp_oem_pkt *)rnh;
+
+    /* code/reason, mfr_id, command ID and the MAC, padded to 4 bytes */
+    rnh->common.length = htons(16);
+    memcpy(&rsp->data[INTEL_MAC_ADDR_OFFSET], slirp->ncsi_mac, ETH_ALEN);
+
+    return 0;
+}
+
+/* Response handler for Intel command Keep PHY Link Up */
+static int ncsi_rsp_handler_oem_intel_keep_phy(Slirp *slirp,
+                                               const struct ncsi_pkt_hdr *nh,
+                                               struct ncsi_rsp_pkt_hdr *rnh)
+{
+    const struct ncsi_cmd_oem_pkt *cmd = (const struct ncsi_cmd_oem_pkt *)nh;
+    struct ncsi_rsp_oem_pkt *rsp = (struct ncsi_rsp_oem_pkt *)rnh;
+
+    /* Echo the two parameter bytes back */
+    rnh->common.length = htons(12);
+    rsp->data[1] = cmd->data[1];
+    rsp->data[2] = cmd->data[2];
+
+    return 0;
+}
+
+static const struct ncsi_oem_handler ncsi_rsp_oem_intel_handlers[256] = {
+    [NCSI_OEM_INTEL_CMD_GMA] = { 5, ncsi_rsp_handler_oem_intel_gma },
+    [NCSI_OEM_INTEL_CMD_KEEP_PHY] = { 7, ncsi_rsp_handler_oem_intel_keep_phy },
+};
+
+/* Response handler for Intel card */
+static int ncsi_rsp_handler_oem_intel(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                                      struct ncsi_rsp_pkt_hdr *rnh)
+{
+    const struct ncsi_cmd_oem_pkt *cmd = (const struct ncsi_cmd_oem_pkt *)nh;
+    const struct ncsi_cmd_oem_intel_pkt *intel_cmd =
+        (const struct ncsi_cmd_oem_intel_pkt *)cmd->data;
+    struct ncsi_rsp_oem_pkt *rsp = (struct ncsi_rsp_oem_pkt *)rnh;
+    struct ncsi_rsp_oem_intel_pkt *intel_rsp =
+        (struct ncsi_rsp_oem_intel_pkt *)rsp->data;
+    const struct ncsi_oem_handler *handler;
+
+    if (ntohs(nh->length) < 4 + sizeof(*intel_cmd)) {
+        return ncsi_rsp_length_error(rnh);
+    }
+    intel_rsp->cmd = intel_cmd->cmd;
+
+    handler = &ncsi_rsp_oem_intel_handlers[intel_cmd->cmd];
+    if (!handler->handler) {
+        return 0;
+    }
+    if (ntohs(nh->length) < handler->cmd_payload) {
+        return ncsi_rsp_length_error(rnh);
+    }
+    return handler->handler(slirp, nh, rnh);
+}
+
+const struct ncsi_personality ncsi_personality_intel = {
+    .mfr_id = NCSI_OEM_MFR_INTEL_ID,
+    .name = "intel",
+    .fw_name = "intel0.1",
+    .fw_version = 0x00010000,
+    .pci_ids = { 0x1533, 0x8086, 0x0001, 0x8086 }, /* I210 */
+    .cap = ~0,
+    .bc_cap = ~0,
+    .mc_cap = ~0,
+    .buf_cap = ~0,
+    .aen_cap = ~0,
+    .vlan_mode = 0xff,
+    .uc_cnt = NCSI_MAX_MAC_FILTERS,
+    .oem_handler = ncsi_rsp_handler_oem_intel,
+};
@@ -0,0 +1,103 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * NC-SI Mellanox personality
+ */
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include "ncsi.h"
+
+/* Response handler for Mellanox command Get Mac Address */
+static int ncsi_rsp_handler_oem_mlx_gma(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                                        struct ncsi_rsp_pkt_hdr *rnh)
+{
+    const struct ncsi_cmd_oem_pkt *cmd = (const struct ncsi_cmd_oem_pkt *)nh;
+    const struct ncsi_cmd_oem_mlx_pkt *mlx_cmd =
+        (const struct ncsi_cmd_oem_mlx_pkt *)cmd->data;
+    struct ncsi_rsp_oem_pkt *rsp = (struct ncsi_rsp_oem_pkt *)rnh;
+
+    if (mlx_cmd->param != NCSI_OEM_MLX_CMD_GMA_PARAM) {
+        return 0;
+    }
+
+    rnh->common.length = htons(24);
+    memcpy(&rsp->data[MLX_MAC_ADDR_OFFSET], slirp->ncsi_mac, ETH_ALEN);
+
+    return 0;
+}
+
+/* Response handler for Mellanox command Set MC Affinity */
+static int ncsi_rsp_handler_oem_mlx_smaf(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                                         struct ncsi_rsp_pkt_hdr *rnh)
+{
+    const struct ncsi_cmd_oem_pkt *cmd = (const struct ncsi_cmd_oem_pkt *)nh;
+    const struct ncsi_cmd_oem_mlx_pkt *mlx_cmd =
+        (const struct ncsi_cmd_oem_mlx_pkt *)cmd->data;
+    struct ncsi_rsp_oem_pkt *rsp = (struct ncsi_rsp_oem_pkt *)rnh;
+    unsigned char host_number = cmd->data[3];
+
+    if (mlx_cmd->param != NCSI_OEM_MLX_CMD_SMAF_PARAM) {
+        return 0;
+    }
+
+    rnh->common.length = htons(12);
+    rsp->data[0] = 0x00;
+    rsp->data[1] = 0x01;
+    rsp->data[2] = 0x07;
+    rsp->data[3] = host_number;
+
+    return 0;
+}
+
+static const struct ncsi_oem_handler ncsi_rsp_oem_mlx_handlers[256] = {
+    [NCSI_OEM_MLX_CMD_GMA] = { 8, ncsi_rsp_handler_oem_mlx_gma },
+    [NCSI_OEM_MLX_CMD_SMAF] = { 8, ncsi_rsp_handler_oem_mlx_smaf },
+};
+
+/* Response handler for Mellanox card */
+static int ncsi_rsp_handler_oem_mlx(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                                    struct ncsi_rsp_pkt_hdr *rnh)
+{
+    const struct ncsi_cmd_oem_pkt *cmd;
+    const struct ncsi_cmd_oem_mlx_pkt *mlx_cmd;
+    struct ncsi_rsp_oem_pkt *rsp;
+    struct ncsi_rsp_oem_mlx_pkt *mlx_rsp;
+    const struct ncsi_oem_handler *handler;
+
+    if (ntohs(nh->length) < 4 + sizeof(*mlx_cmd)) {
+        return ncsi_rsp_length_error(rnh);
+    }
+    cmd = (const struct ncsi_cmd_oem_pkt *)nh;
+    rsp = (struct ncsi_rsp_oem_pkt *)rnh;
+    mlx_cmd = (const struct ncsi_cmd_oem_mlx_pkt *)cmd->data;
+    mlx_rsp = (struct ncsi_rsp_oem_mlx_pkt *)rsp->data;
+    mlx_rsp->cmd_rev = mlx_cmd->cmd_rev;
+    mlx_rsp->cmd = mlx_cmd->cmd;
+    mlx_rsp->param = mlx_cmd->param;
+
+    handler = &ncsi_rsp_oem_mlx_handlers[mlx_cmd->cmd];
+    if (!handler->handler) {
+        return 0;
+    }
+    if (ntohs(nh->length) < handler->cmd_payload) {
+        return ncsi_rsp_length_error(rnh);
+    }
+    return handler->handler(slirp, nh, rnh);
+}
+
+const struct ncsi_personality ncsi_personality_mlx = {
+    .mfr_id = NCSI_OEM_MFR_MLX_ID,
+    .name = "mlx",
+    .fw_name = "mlx0.1",
+    .fw_version = 0x00010000,
+    .pci_ids = { 0x1015, 0x15b3, 0x0001, 0x15b3 }, /* ConnectX-4 Lx */
+    .cap = ~0,
+    .bc_cap = ~0,
+    .mc_cap = ~0,
+    .buf_cap = ~0,
+    .aen_cap = ~0,
+    .vlan_mode = 0xff,
+    .uc_cnt = NCSI_MAX_MAC_FILTERS,
+    .oem_handler = ncsi_rsp_handler_oem_mlx,
+};
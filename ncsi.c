@@ -60,29 +60,317 @@ static uint32_t ncsi_calculate_checksum(uint8_t *data, int len)
     return checksum;
 }
 
+static struct ncsi_package_state *ncsi_package(Slirp *slirp,
+                                               unsigned char channel)
+{
+    return &slirp->state->packages[NCSI_PACKAGE_INDEX(channel)];
+}
+
+/* Returns NULL for package-wide commands, which address no channel. */
+static struct ncsi_channel_state *ncsi_channel(Slirp *slirp,
+                                               unsigned char channel)
+{
+    if (NCSI_CHANNEL_INDEX(channel) == NCSI_RESERVED_CHANNEL) {
+        return NULL;
+    }
+    return &slirp->state->channels[NCSI_PACKAGE_INDEX(channel)]
+                                  [NCSI_CHANNEL_INDEX(channel)];
+}
+
+static int ncsi_rsp_error(struct ncsi_rsp_pkt_hdr *rnh, uint16_t code,
+                          uint16_t reason)
+{
+    rnh->common.length = htons(4);
+    rnh->code = htons(code);
+    rnh->reason = htons(reason);
+    return -1;
+}
+
+/* Clear Initial State */
+static int ncsi_rsp_handler_cis(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                                struct ncsi_rsp_pkt_hdr *rnh)
+{
+    struct ncsi_channel_state *nc = ncsi_channel(slirp, nh->channel);
+
+    if (nc) {
+        __atomic_store_n(&nc->initialized, 1, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+/* Select Package */
+static int ncsi_rsp_handler_sp(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                               struct ncsi_rsp_pkt_hdr *rnh)
+{
+    const struct ncsi_cmd_sp_pkt *cmd = (const struct ncsi_cmd_sp_pkt *)nh;
+    struct ncsi_package_state *np = ncsi_package(slirp, nh->channel);
+
+    np->selected = 1;
+    np->hw_arbitration = cmd->hw_arbitration & 0x1;
+    return 0;
+}
+
 /* Deselect Package */
 static int ncsi_rsp_handler_dp(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
                                struct ncsi_rsp_pkt_hdr *rnh)
 {
+    ncsi_package(slirp, nh->channel)->selected = 0;
+
     // Make sure it's not 0x1f, which is usually copied from the command
-    // header.
-    rnh->common.channel = 0x00;
+    // header, but keep the package.
+    rnh->common.channel = nh->channel & ~NCSI_RESERVED_CHANNEL;
 
     return 0;
 }
 
-static const char *get_mfr_name(uint32_t mfr_id)
+/* Enable Channel */
+static int ncsi_rsp_handler_ec(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                               struct ncsi_rsp_pkt_hdr *rnh)
 {
-    switch (mfr_id) {
-    case NCSI_OEM_MFR_MLX_ID:
-        return "mlx";
-    case NCSI_OEM_MFR_BCM_ID:
-        return "bcm";
-    case NCSI_OEM_MFR_INTEL_ID:
-        return "intel";
-    default:
-        return "nic";
+    struct ncsi_channel_state *nc = ncsi_channel(slirp, nh->channel);
+
+    if (nc) {
+        nc->enabled = 1;
+    }
+    return 0;
+}
+
+/* Disable Channel */
+static int ncsi_rsp_handler_dc(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                               struct ncsi_rsp_pkt_hdr *rnh)
+{
+    struct ncsi_channel_state *nc = ncsi_channel(slirp, nh->channel);
+
+    if (nc) {
+        nc->enabled = 0;
+    }
+    return 0;
+}
+
+/* Reset Channel */
+static int ncsi_rsp_handler_rc(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                               struct ncsi_rsp_pkt_hdr *rnh)
+{
+    struct ncsi_channel_state *nc = ncsi_channel(slirp, nh->channel);
+
+    if (nc) {
+        /*
+         * Back to the initial state; the counters survive a reset. This may
+         * run on a worker while the main loop sends AENs for the channel,
+         * so the fields it reads are cleared atomically, and the counters,
+         * which it also updates, are left alone.
+         */
+        __atomic_store_n(&nc->initialized, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&nc->aen_mc_id, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&nc->aen_mode, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&nc->aen_pending, 0, __ATOMIC_RELAXED);
+        nc->enabled = 0;
+        nc->tx_enabled = 0;
+        nc->bc_enabled = 0;
+        nc->mc_enabled = 0;
+        nc->vlan_mode = 0;
+        nc->fc_mode = 0;
+        nc->mac_enable = 0;
+        nc->vlan_enable = 0;
+        memset(nc->vlan, 0, sizeof(nc->vlan));
+        memset(nc->mac, 0, sizeof(nc->mac));
+        nc->link_mode = 0;
+        nc->oem_link_mode = 0;
+        nc->bc_mode = 0;
+        nc->mc_mode = 0;
+    }
+    return 0;
+}
+
+/* Enable Channel Network Tx */
+static int ncsi_rsp_handler_ecnt(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                                 struct ncsi_rsp_pkt_hdr *rnh)
+{
+    struct ncsi_channel_state *nc = ncsi_channel(slirp, nh->channel);
+
+    if (nc) {
+        nc->tx_enabled = 1;
+    }
+    return 0;
+}
+
+/* Disable Channel Network Tx */
+static int ncsi_rsp_handler_dcnt(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                                 struct ncsi_rsp_pkt_hdr *rnh)
+{
+    struct ncsi_channel_state *nc = ncsi_channel(slirp, nh->channel);
+
+    if (nc) {
+        nc->tx_enabled = 0;
+    }
+    return 0;
+}
+
+/* AEN Enable */
+static int ncsi_rsp_handler_ae(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                               struct ncsi_rsp_pkt_hdr *rnh)
+{
+    const struct ncsi_cmd_ae_pkt *cmd = (const struct ncsi_cmd_ae_pkt *)nh;
+    struct ncsi_channel_state *nc = ncsi_channel(slirp, nh->channel);
+
+    if (nc) {
+        __atomic_store_n(&nc->aen_mc_id, cmd->mc_id, __ATOMIC_RELAXED);
+        __atomic_store_n(&nc->aen_mode, ntohl(cmd->mode), __ATOMIC_RELAXED);
+        __atomic_store_n(&slirp->state->aen_dirty, 1, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/* Set Link */
+static int ncsi_rsp_handler_sl(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                               struct ncsi_rsp_pkt_hdr *rnh)
+{
+    const struct ncsi_cmd_sl_pkt *cmd = (const struct ncsi_cmd_sl_pkt *)nh;
+    struct ncsi_channel_state *nc = ncsi_channel(slirp, nh->channel);
+
+    if (nc) {
+        nc->link_mode = ntohl(cmd->mode);
+        nc->oem_link_mode = ntohl(cmd->oem_mode);
+    }
+    return 0;
+}
+
+/* Set VLAN Filter */
+static int ncsi_rsp_handler_svf(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                                struct ncsi_rsp_pkt_hdr *rnh)
+{
+    const struct ncsi_cmd_svf_pkt *cmd = (const struct ncsi_cmd_svf_pkt *)nh;
+    struct ncsi_channel_state *nc = ncsi_channel(slirp, nh->channel);
+    int index = cmd->index - 1;
+
+    if (!nc) {
+        return 0;
+    }
+    if (index < 0 || index >= NCSI_MAX_VLAN_FILTERS) {
+        return ncsi_rsp_error(rnh, NCSI_PKT_RSP_C_FAILED,
+                              NCSI_PKT_RSP_R_PARAM);
+    }
+    nc->vlan[index] = ntohs(cmd->vlan) & 0xfff;
+    if (cmd->enable & 0x1) {
+        nc->vlan_enable |= 1 << index;
+    } else {
+        nc->vlan_enable &= ~(1 << index);
+    }
+    return 0;
+}
+
+/* Enable VLAN */
+static int ncsi_rsp_handler_ev(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                               struct ncsi_rsp_pkt_hdr *rnh)
+{
+    const struct ncsi_cmd_ev_pkt *cmd = (const struct ncsi_cmd_ev_pkt *)nh;
+    struct ncsi_channel_state *nc = ncsi_channel(slirp, nh->channel);
+
+    if (nc) {
+        nc->vlan_mode = cmd->mode;
+    }
+    return 0;
+}
+
+/* Disable VLAN */
+static int ncsi_rsp_handler_dv(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                               struct ncsi_rsp_pkt_hdr *rnh)
+{
+    struct ncsi_channel_state *nc = ncsi_channel(slirp, nh->channel);
+
+    if (nc) {
+        nc->vlan_mode = 0;
+    }
+    return 0;
+}
+
+/* Set MAC Address */
+static int ncsi_rsp_handler_sma(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                                struct ncsi_rsp_pkt_hdr *rnh)
+{
+    const struct ncsi_cmd_sma_pkt *cmd = (const struct ncsi_cmd_sma_pkt *)nh;
+    struct ncsi_channel_state *nc = ncsi_channel(slirp, nh->channel);
+    int index = cmd->index - 1;
+
+    if (!nc) {
+        return 0;
+    }
+    if (index < 0 || index >= NCSI_MAX_MAC_FILTERS) {
+        return ncsi_rsp_error(rnh, NCSI_PKT_RSP_C_FAILED,
+                              NCSI_PKT_RSP_R_PARAM);
+    }
+    memcpy(nc->mac[index], cmd->mac, ETH_ALEN);
+    if (cmd->at_e & 0x1) {
+        nc->mac_enable |= 1 << index;
+    } else {
+        nc->mac_enable &= ~(1 << index);
+    }
+    return 0;
+}
+
+/* Enable Broadcast Filter */
+static int ncsi_rsp_handler_ebf(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                                struct ncsi_rsp_pkt_hdr *rnh)
+{
+    const struct ncsi_cmd_ebf_pkt *cmd = (const struct ncsi_cmd_ebf_pkt *)nh;
+    struct ncsi_channel_state *nc = ncsi_channel(slirp, nh->channel);
+
+    if (nc) {
+        nc->bc_enabled = 1;
+        nc->bc_mode = ntohl(cmd->mode);
+    }
+    return 0;
+}
+
+/* Disable Broadcast Filter */
+static int ncsi_rsp_handler_dbf(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                                struct ncsi_rsp_pkt_hdr *rnh)
+{
+    struct ncsi_channel_state *nc = ncsi_channel(slirp, nh->channel);
+
+    if (nc) {
+        nc->bc_enabled = 0;
+    }
+    return 0;
+}
+
+/* Enable Global Multicast Filter */
+static int ncsi_rsp_handler_egmf(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                                 struct ncsi_rsp_pkt_hdr *rnh)
+{
+    const struct ncsi_cmd_egmf_pkt *cmd = (const struct ncsi_cmd_egmf_pkt *)nh;
+    struct ncsi_channel_state *nc = ncsi_channel(slirp, nh->channel);
+
+    if (nc) {
+        nc->mc_enabled = 1;
+        nc->mc_mode = ntohl(cmd->mode);
+    }
+    return 0;
+}
+
+/* Disable Global Multicast Filter */
+static int ncsi_rsp_handler_dgmf(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                                 struct ncsi_rsp_pkt_hdr *rnh)
+{
+    struct ncsi_channel_state *nc = ncsi_channel(slirp, nh->channel);
+
+    if (nc) {
+        nc->mc_enabled = 0;
+    }
+    return 0;
+}
+
+/* Set NCSI Flow Control */
+static int ncsi_rsp_handler_snfc(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                                 struct ncsi_rsp_pkt_hdr *rnh)
+{
+    const struct ncsi_cmd_snfc_pkt *cmd = (const struct ncsi_cmd_snfc_pkt *)nh;
+    struct ncsi_channel_state *nc = ncsi_channel(slirp, nh->channel);
+
+    if (nc) {
+        nc->fc_mode = cmd->mode;
     }
+    return 0;
 }
 
 /* Get Version ID */
@@ -90,12 +378,16 @@ static int ncsi_rsp_handler_gvi(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
                                 struct ncsi_rsp_pkt_hdr *rnh)
 {
     struct ncsi_rsp_gvi_pkt *rsp = (struct ncsi_rsp_gvi_pkt *)rnh;
-    const char *mfr_name = get_mfr_name(slirp->mfr_id);
+    const struct ncsi_personality *np = slirp->personality;
+    int i;
 
     rsp->ncsi_version = htonl(0xF1F0F000);
     rsp->mf_id = htonl(slirp->mfr_id);
-    snprintf((char *)rsp->fw_name, sizeof(rsp->fw_name), "%s0.1", mfr_name);
-    rsp->fw_version = htonl(0x00010000);
+    memcpy(rsp->fw_name, np->fw_name, sizeof(rsp->fw_name));
+    rsp->fw_version = htonl(np->fw_version);
+    for (i = 0; i < ARRAY_SIZE(rsp->pci_ids); i++) {
+        rsp->pci_ids[i] = htons(np->pci_ids[i]);
+    }
 
     return 0;
 }
@@ -105,14 +397,15 @@ static int ncsi_rsp_handler_gc(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
                                struct ncsi_rsp_pkt_hdr *rnh)
 {
     struct ncsi_rsp_gc_pkt *rsp = (struct ncsi_rsp_gc_pkt *)rnh;
-
-    rsp->cap = htonl(~0);
-    rsp->bc_cap = htonl(~0);
-    rsp->mc_cap = htonl(~0);
-    rsp->buf_cap = htonl(~0);
-    rsp->aen_cap = htonl(~0);
-    rsp->vlan_mode = 0xff;
-    rsp->uc_cnt = 2;
+    const struct ncsi_personality *np = slirp->personality;
+
+    rsp->cap = htonl(np->cap);
+    rsp->bc_cap = htonl(np->bc_cap);
+    rsp->mc_cap = htonl(np->mc_cap);
+    rsp->buf_cap = htonl(np->buf_cap);
+    rsp->aen_cap = htonl(np->aen_cap);
+    rsp->vlan_mode = np->vlan_mode;
+    rsp->uc_cnt = np->uc_cnt;
     return 0;
 }
 
@@ -122,7 +415,7 @@ static int ncsi_rsp_handler_gls(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
 {
     struct ncsi_rsp_gls_pkt *rsp = (struct ncsi_rsp_gls_pkt *)rnh;
 
-    rsp->status = htonl(0x1);
+    rsp->status = htonl(__atomic_load_n(&slirp->link_status, __ATOMIC_RELAXED));
     return 0;
 }
 
@@ -131,116 +424,89 @@ static int ncsi_rsp_handler_gp(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
                                struct ncsi_rsp_pkt_hdr *rnh)
 {
     struct ncsi_rsp_gp_pkt *rsp = (struct ncsi_rsp_gp_pkt *)rnh;
+    struct ncsi_channel_state *nc = ncsi_channel(slirp, nh->channel);
+    uint32_t flags = 0;
 
-    /* no MAC address filters or VLAN filters on the channel */
+    /*
+     * The fixed-size response has no room for the filter tables, so don't
+     * report any MAC address filters or VLAN filters on the channel.
+     */
     rsp->mac_cnt = 0;
     rsp->mac_enable = 0;
     rsp->vlan_cnt = 0;
     rsp->vlan_enable = 0;
 
-    return 0;
-}
-
-/* Response handler for Mellanox command Get Mac Address */
-static int ncsi_rsp_handler_oem_mlx_gma(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
-                                        struct ncsi_rsp_pkt_hdr *rnh)
-{
-    struct ncsi_rsp_oem_pkt *rsp = (struct ncsi_rsp_oem_pkt *)rnh;
-
-    rnh->common.length = htons(24);
-    memcpy(&rsp->data[MLX_MAC_ADDR_OFFSET], slirp->ncsi_mac, ETH_ALEN);
-
-    return 0;
-}
-
-/* Response handler for Mellanox command Set MC Affinity */
-static int ncsi_rsp_handler_oem_mlx_smaf(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
-                                         struct ncsi_rsp_pkt_hdr *rnh)
-{
-    const struct ncsi_cmd_oem_pkt *cmd = (const struct ncsi_cmd_oem_pkt *)nh;
-    struct ncsi_rsp_oem_pkt *rsp = (struct ncsi_rsp_oem_pkt *)rnh;
-    unsigned char host_number = cmd->data[3];
-
-    rnh->common.length = htons(12);
-    rsp->data[0] = 0x00;
-    rsp->data[1] = 0x01;
-    rsp->data[2] = 0x07;
-    rsp->data[3] = host_number;
+    if (!nc) {
+        return 0;
+    }
+    if (nc->bc_enabled) {
+        flags |= NCSI_GP_FLAG_BC;
+    }
+    if (nc->enabled) {
+        flags |= NCSI_GP_FLAG_EC;
+    }
+    if (nc->tx_enabled) {
+        flags |= NCSI_GP_FLAG_TX;
+    }
+    if (nc->mc_enabled) {
+        flags |= NCSI_GP_FLAG_MC;
+    }
+    rsp->link_mode = htonl(nc->link_mode);
+    rsp->bc_mode = htonl(nc->bc_mode);
+    rsp->valid_modes = htonl(flags);
+    rsp->vlan_mode = nc->vlan_mode;
+    rsp->fc_mode = nc->fc_mode;
+    rsp->aen_mode = htonl(nc->aen_mode);
 
     return 0;
 }
 
-/* Response handler for Mellanox card */
-static int ncsi_rsp_handler_oem_mlx(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
-                                    struct ncsi_rsp_pkt_hdr *rnh)
+/* Get NCSI Statistics */
+static int ncsi_rsp_handler_gns(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                                struct ncsi_rsp_pkt_hdr *rnh)
 {
-    const struct ncsi_cmd_oem_pkt *cmd;
-    const struct ncsi_cmd_oem_mlx_pkt *mlx_cmd;
-    struct ncsi_rsp_oem_pkt *rsp;
-    struct ncsi_rsp_oem_mlx_pkt *mlx_rsp;
+    struct ncsi_rsp_gns_pkt *rsp = (struct ncsi_rsp_gns_pkt *)rnh;
+    struct ncsi_channel_state *nc = ncsi_channel(slirp, nh->channel);
 
-    cmd = (const struct ncsi_cmd_oem_pkt *)nh;
-    rsp = (struct ncsi_rsp_oem_pkt *)rnh;
-    mlx_cmd = (const struct ncsi_cmd_oem_mlx_pkt *)cmd->data;
-    mlx_rsp = (struct ncsi_rsp_oem_mlx_pkt *)rsp->data;
-    mlx_rsp->cmd_rev = mlx_cmd->cmd_rev;
-    mlx_rsp->cmd = mlx_cmd->cmd;
-    mlx_rsp->param = mlx_cmd->param;
-
-    if (mlx_cmd->cmd == NCSI_OEM_MLX_CMD_GMA &&
-        mlx_cmd->param == NCSI_OEM_MLX_CMD_GMA_PARAM) {
-        return ncsi_rsp_handler_oem_mlx_gma(slirp, nh, rnh);
-    }
-    if (mlx_cmd->cmd == NCSI_OEM_MLX_CMD_SMAF &&
-        mlx_cmd->param == NCSI_OEM_MLX_CMD_SMAF_PARAM) {
-        return ncsi_rsp_handler_oem_mlx_smaf(slirp, nh, rnh);
+    if (!nc) {
+        return 0;
     }
+    rsp->rx_cmds = htonl(nc->stats.rx_cmds);
+    rsp->dropped_cmds = htonl(nc->stats.dropped_cmds);
+    rsp->cmd_type_errs = htonl(nc->stats.cmd_type_errs);
+    rsp->cmd_csum_errs = htonl(nc->stats.cmd_csum_errs);
+    rsp->rx_pkts = htonl(nc->stats.rx_pkts);
+    rsp->tx_pkts = htonl(nc->stats.tx_pkts);
+    rsp->tx_aen_pkts = htonl(__atomic_load_n(&nc->stats.tx_aen_pkts,
+                                             __ATOMIC_RELAXED));
 
     return 0;
 }
 
-static struct ncsi_rsp_oem_handler {
-    uint32_t mfr_id;
-    int (*handler)(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
-                   struct ncsi_rsp_pkt_hdr *rnh);
-} ncsi_rsp_oem_handlers[] = {
-    { NCSI_OEM_MFR_MLX_ID, ncsi_rsp_handler_oem_mlx },
-    { NCSI_OEM_MFR_BCM_ID, NULL },
-    { NCSI_OEM_MFR_INTEL_ID, NULL },
-};
-
 /* OEM Command */
 static int ncsi_rsp_handler_oem(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
                                 struct ncsi_rsp_pkt_hdr *rnh)
 {
     const struct ncsi_cmd_oem_pkt *cmd = (const struct ncsi_cmd_oem_pkt *)nh;
-    const struct ncsi_rsp_oem_handler *handler = NULL;
+    ncsi_rsp_handler_fn handler = slirp->personality->oem_handler;
     struct ncsi_rsp_oem_pkt *rsp = (struct ncsi_rsp_oem_pkt *)rnh;
     uint32_t mfr_id = ntohl(cmd->mfr_id);
-    int i;
 
     if (mfr_id != slirp->mfr_id) {
-        rnh->common.length = 0;
+        rnh->common.length = htons(4);
         rnh->code = htons(NCSI_PKT_RSP_C_UNSUPPORTED);
         rnh->reason = htons(NCSI_PKT_RSP_R_UNKNOWN);
         return -1;
     }
     rsp->mfr_id = cmd->mfr_id;
 
-    for (i = 0; i < ARRAY_SIZE(ncsi_rsp_oem_handlers); i++) {
-        if (ncsi_rsp_oem_handlers[i].mfr_id == mfr_id) {
-            handler = &ncsi_rsp_oem_handlers[i];
-            break;
-        }
-    }
-
     if (!handler) {
-        rnh->common.length = 0;
+        rnh->common.length = htons(4);
         rnh->code = htons(NCSI_PKT_RSP_C_UNAVAILABLE);
         rnh->reason = htons(NCSI_PKT_RSP_R_UNKNOWN);
         return -1;
     }
-    return handler->handler(slirp, nh, rnh);
+    return handler(slirp, nh, rnh);
 }
 
 /* PLDM Command */
@@ -250,71 +516,116 @@ static int ncsi_rsp_handler_pldm(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
     return 0;
 }
 
+/* Any other manufacturer: no OEM commands */
+static const struct ncsi_personality ncsi_personality_generic = {
+    .name = "nic",
+    .fw_name = "nic0.1",
+    .fw_version = 0x00010000,
+    .cap = ~0,
+    .bc_cap = ~0,
+    .mc_cap = ~0,
+    .buf_cap = ~0,
+    .aen_cap = ~0,
+    .vlan_mode = 0xff,
+    .uc_cnt = NCSI_MAX_MAC_FILTERS,
+};
+
+static const struct ncsi_personality *const ncsi_personalities[] = {
+    &ncsi_personality_mlx,
+    &ncsi_personality_bcm,
+    &ncsi_personality_intel,
+};
+
+const struct ncsi_personality *ncsi_set_mfr_id(Slirp *slirp, uint32_t mfr_id)
+{
+    int i;
+
+    slirp->mfr_id = mfr_id;
+    slirp->personality = &ncsi_personality_generic;
+    for (i = 0; i < ARRAY_SIZE(ncsi_personalities); i++) {
+        if (ncsi_personalities[i]->mfr_id == mfr_id) {
+            slirp->personality = ncsi_personalities[i];
+            break;
+        }
+    }
+    return slirp->personality;
+}
+
+const struct ncsi_personality *ncsi_find_personality(const char *name)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(ncsi_personalities); i++) {
+        if (strcmp(ncsi_personalities[i]->name, name) == 0) {
+            return ncsi_personalities[i];
+        }
+    }
+    return NULL;
+}
+
+int ncsi_rsp_length_error(struct ncsi_rsp_pkt_hdr *rnh)
+{
+    rnh->common.length = htons(4); /* Code and reason */
+    rnh->code = htons(NCSI_PKT_RSP_C_UNAVAILABLE);
+    rnh->reason = htons(NCSI_PKT_RSP_R_LENGTH);
+    return -1;
+}
+
 static const struct ncsi_rsp_handler {
     unsigned char type;
+    int cmd_payload; /* Shortest command payload the handler accepts */
     int payload;
     int (*handler)(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
                    struct ncsi_rsp_pkt_hdr *rnh);
-} ncsi_rsp_handlers[] = { { NCSI_PKT_RSP_CIS, 4, NULL },
-                          { NCSI_PKT_RSP_SP, 4, NULL },
-                          { NCSI_PKT_RSP_DP, 4, ncsi_rsp_handler_dp },
-                          { NCSI_PKT_RSP_EC, 4, NULL },
-                          { NCSI_PKT_RSP_DC, 4, NULL },
-                          { NCSI_PKT_RSP_RC, 4, NULL },
-                          { NCSI_PKT_RSP_ECNT, 4, NULL },
-                          { NCSI_PKT_RSP_DCNT, 4, NULL },
-                          { NCSI_PKT_RSP_AE, 4, NULL },
-                          { NCSI_PKT_RSP_SL, 4, NULL },
-                          { NCSI_PKT_RSP_GLS, 16, ncsi_rsp_handler_gls },
-                          { NCSI_PKT_RSP_SVF, 4, NULL },
-                          { NCSI_PKT_RSP_EV, 4, NULL },
-                          { NCSI_PKT_RSP_DV, 4, NULL },
-                          { NCSI_PKT_RSP_SMA, 4, NULL },
-                          { NCSI_PKT_RSP_EBF, 4, NULL },
-                          { NCSI_PKT_RSP_DBF, 4, NULL },
-                          { NCSI_PKT_RSP_EGMF, 4, NULL },
-                          { NCSI_PKT_RSP_DGMF, 4, NULL },
-                          { NCSI_PKT_RSP_SNFC, 4, NULL },
-                          { NCSI_PKT_RSP_GVI, 40, ncsi_rsp_handler_gvi },
-                          { NCSI_PKT_RSP_GC, 32, ncsi_rsp_handler_gc },
-                          { NCSI_PKT_RSP_GP, 40, ncsi_rsp_handler_gp },
-                          { NCSI_PKT_RSP_GCPS, 172, NULL },
-                          { NCSI_PKT_RSP_GNS, 172, NULL },
-                          { NCSI_PKT_RSP_GNPTS, 172, NULL },
-                          { NCSI_PKT_RSP_GPS, 8, NULL },
-                          { NCSI_PKT_RSP_OEM, 0, ncsi_rsp_handler_oem },
-                          { NCSI_PKT_RSP_PLDM, 8, ncsi_rsp_handler_pldm },
-                          { NCSI_PKT_RSP_GPUUID, 20, NULL } };
-
-/*
- * packet format : ncsi header + payload + checksum
- */
-#define NCSI_MAX_PAYLOAD 172
-#define NCSI_MAX_LEN (sizeof(struct ncsi_pkt_hdr) + NCSI_MAX_PAYLOAD + 4)
-
-void ncsi_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
+} ncsi_rsp_handlers[] = { { NCSI_PKT_RSP_CIS, 0, 4, ncsi_rsp_handler_cis },
+                          { NCSI_PKT_RSP_SP, 4, 4, ncsi_rsp_handler_sp },
+                          { NCSI_PKT_RSP_DP, 0, 4, ncsi_rsp_handler_dp },
+                          { NCSI_PKT_RSP_EC, 0, 4, ncsi_rsp_handler_ec },
+                          { NCSI_PKT_RSP_DC, 4, 4, ncsi_rsp_handler_dc },
+                          { NCSI_PKT_RSP_RC, 4, 4, ncsi_rsp_handler_rc },
+                          { NCSI_PKT_RSP_ECNT, 0, 4, ncsi_rsp_handler_ecnt },
+                          { NCSI_PKT_RSP_DCNT, 0, 4, ncsi_rsp_handler_dcnt },
+                          { NCSI_PKT_RSP_AE, 8, 4, ncsi_rsp_handler_ae },
+                          { NCSI_PKT_RSP_SL, 8, 4, ncsi_rsp_handler_sl },
+                          { NCSI_PKT_RSP_GLS, 0, 16, ncsi_rsp_handler_gls },
+                          { NCSI_PKT_RSP_SVF, 8, 4, ncsi_rsp_handler_svf },
+                          { NCSI_PKT_RSP_EV, 4, 4, ncsi_rsp_handler_ev },
+                          { NCSI_PKT_RSP_DV, 0, 4, ncsi_rsp_handler_dv },
+                          { NCSI_PKT_RSP_SMA, 8, 4, ncsi_rsp_handler_sma },
+                          { NCSI_PKT_RSP_EBF, 4, 4, ncsi_rsp_handler_ebf },
+                          { NCSI_PKT_RSP_DBF, 0, 4, ncsi_rsp_handler_dbf },
+                          { NCSI_PKT_RSP_EGMF, 4, 4, ncsi_rsp_handler_egmf },
+                          { NCSI_PKT_RSP_DGMF, 0, 4, ncsi_rsp_handler_dgmf },
+                          { NCSI_PKT_RSP_SNFC, 4, 4, ncsi_rsp_handler_snfc },
+                          { NCSI_PKT_RSP_GVI, 0, 40, ncsi_rsp_handler_gvi },
+                          { NCSI_PKT_RSP_GC, 0, 32, ncsi_rsp_handler_gc },
+                          { NCSI_PKT_RSP_GP, 0, 40, ncsi_rsp_handler_gp },
+                          { NCSI_PKT_RSP_GCPS, 0, 172, NULL },
+                          { NCSI_PKT_RSP_GNS, 0, 172, ncsi_rsp_handler_gns },
+                          { NCSI_PKT_RSP_GNPTS, 0, 172, NULL },
+                          { NCSI_PKT_RSP_GPS, 0, 8, NULL },
+                          { NCSI_PKT_RSP_OEM, 4, 0, ncsi_rsp_handler_oem },
+                          { NCSI_PKT_RSP_PLDM, 0, 8, ncsi_rsp_handler_pldm },
+                          { NCSI_PKT_RSP_GPUUID, 0, 20, NULL } };
+
+int ncsi_process(Slirp *slirp, const uint8_t *cmd, int cmd_len, uint8_t *rsp)
 {
-    const struct ncsi_pkt_hdr *nh =
-        (const struct ncsi_pkt_hdr *)(pkt + ETH_HLEN);
-    uint8_t ncsi_reply[ETH_HLEN + NCSI_MAX_LEN];
-    struct ethhdr *reh = (struct ethhdr *)ncsi_reply;
-    struct ncsi_rsp_pkt_hdr *rnh =
-        (struct ncsi_rsp_pkt_hdr *)(ncsi_reply + ETH_HLEN);
+    const struct ncsi_pkt_hdr *nh = (const struct ncsi_pkt_hdr *)cmd;
+    struct ncsi_rsp_pkt_hdr *rnh = (struct ncsi_rsp_pkt_hdr *)rsp;
     const struct ncsi_rsp_handler *handler = NULL;
+    struct ncsi_channel_state *nc;
     int i;
+    int payload_len;
     int ncsi_rsp_len = sizeof(*nh);
     uint32_t checksum;
     uint32_t *pchecksum;
 
-    if (pkt_len < ETH_HLEN + sizeof(struct ncsi_pkt_hdr)) {
-        return; /* packet too short */
+    if (cmd_len < sizeof(struct ncsi_pkt_hdr)) {
+        return -1; /* packet too short */
     }
+    payload_len = ntohs(nh->length);
 
-    memset(ncsi_reply, 0, sizeof(ncsi_reply));
-
-    memset(reh->h_dest, 0xff, ETH_ALEN);
-    memset(reh->h_source, 0xff, ETH_ALEN);
-    reh->h_proto = htons(ETH_P_NCSI);
+    memset(rsp, 0, NCSI_MAX_LEN);
 
     for (i = 0; i < ARRAY_SIZE(ncsi_rsp_handlers); i++) {
         if (ncsi_rsp_handlers[i].type == nh->type + 0x80) {
@@ -323,26 +634,48 @@ void ncsi_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
         }
     }
 
+    nc = ncsi_channel(slirp, nh->channel);
+    if (nc) {
+        nc->stats.rx_pkts++;
+        nc->stats.rx_cmds++;
+    }
+
     rnh->common.mc_id = nh->mc_id;
     rnh->common.revision = NCSI_PKT_REVISION;
     rnh->common.id = nh->id;
     rnh->common.type = nh->type + 0x80;
     rnh->common.channel = nh->channel;
 
-    if (handler) {
+    if (handler && (payload_len > cmd_len - (int)sizeof(*nh) ||
+                    payload_len < handler->cmd_payload)) {
+        /* Handlers may read as far as the payload length says. */
+        ncsi_rsp_length_error(rnh);
+    } else if (handler) {
         rnh->common.length = htons(handler->payload);
         rnh->code = htons(NCSI_PKT_RSP_C_COMPLETED);
         rnh->reason = htons(NCSI_PKT_RSP_R_NO_ERROR);
 
         if (handler->handler) {
+            if (slirp->handler_begin) {
+                slirp->handler_begin();
+            }
             /* TODO: handle errors */
             handler->handler(slirp, nh, rnh);
+            if (slirp->handler_end) {
+                slirp->handler_end(nh->type);
+            }
         }
-        ncsi_rsp_len += ntohs(rnh->common.length);
     } else {
-        rnh->common.length = 0;
+        rnh->common.length = htons(4);
         rnh->code = htons(NCSI_PKT_RSP_C_UNAVAILABLE);
         rnh->reason = htons(NCSI_PKT_RSP_R_UNKNOWN);
+        if (nc) {
+            nc->stats.cmd_type_errs++;
+        }
+    }
+    ncsi_rsp_len += ntohs(rnh->common.length);
+    if (nc) {
+        nc->stats.tx_pkts++;
     }
 
     /* Add the optional checksum at the end of the frame. */
@@ -351,12 +684,159 @@ void ncsi_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
     *pchecksum = htonl(checksum);
     ncsi_rsp_len += 4;
 
-    slirp_send_packet_all(slirp, ncsi_reply, ETH_HLEN + ncsi_rsp_len);
+    return ncsi_rsp_len;
+}
+
+int ncsi_reply(Slirp *slirp, const uint8_t *pkt, int pkt_len, uint8_t *reply)
+{
+    struct ethhdr *reh = (struct ethhdr *)reply;
+    int ncsi_rsp_len;
+
+    if (pkt_len < ETH_HLEN) {
+        return -1; /* packet too short */
+    }
+
+    ncsi_rsp_len = ncsi_process(slirp, pkt + ETH_HLEN, pkt_len - ETH_HLEN,
+                                reply + ETH_HLEN);
+    if (ncsi_rsp_len < 0) {
+        return -1;
+    }
+
+    memset(reh->h_dest, 0xff, ETH_ALEN);
+    memset(reh->h_source, 0xff, ETH_ALEN);
+    reh->h_proto = htons(ETH_P_NCSI);
+
+    return ETH_HLEN + ncsi_rsp_len;
+}
+
+void ncsi_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
+{
+    uint8_t ncsi_reply_frame[ETH_HLEN + NCSI_MAX_LEN];
+    int len;
+
+    len = ncsi_reply(slirp, pkt, pkt_len, ncsi_reply_frame);
+    if (len < 0) {
+        return;
+    }
+    slirp_send_packet_all(slirp, ncsi_reply_frame, len);
+    ncsi_aen_flush(slirp);
+}
+
+static void ncsi_send_aen(Slirp *slirp, unsigned char channel,
+                          struct ncsi_channel_state *nc, unsigned char type)
+{
+    uint8_t ncsi_aen[ETH_HLEN + NCSI_MAX_LEN];
+    struct ethhdr *reh = (struct ethhdr *)ncsi_aen;
+    struct ncsi_aen_pkt_hdr *h = (struct ncsi_aen_pkt_hdr *)(ncsi_aen + ETH_HLEN);
+    int payload;
+    uint32_t checksum;
+    uint32_t *pchecksum;
+
+    memset(ncsi_aen, 0, sizeof(ncsi_aen));
+    memset(reh->h_dest, 0xff, ETH_ALEN);
+    memset(reh->h_source, 0xff, ETH_ALEN);
+    reh->h_proto = htons(ETH_P_NCSI);
+
+    h->common.mc_id = __atomic_load_n(&nc->aen_mc_id, __ATOMIC_RELAXED);
+    h->common.revision = NCSI_PKT_REVISION;
+    h->common.type = NCSI_PKT_AEN;
+    h->common.channel = channel;
+    h->type = type;
+
+    /* AEN payload lengths include the checksum */
+    switch (type) {
+    case NCSI_PKT_AEN_LSC:
+        ((struct ncsi_aen_lsc_pkt *)h)->status =
+            htonl(__atomic_load_n(&slirp->link_status, __ATOMIC_RELAXED));
+        payload = 12;
+        break;
+    case NCSI_PKT_AEN_HNCDSC:
+        ((struct ncsi_aen_hncdsc_pkt *)h)->status = htonl(0x1);
+        payload = 8;
+        break;
+    default:
+        payload = 4;
+        break;
+    }
+    h->common.length = htons(payload);
+
+    checksum = ncsi_calculate_checksum((uint8_t *)h, sizeof(*h) + payload - 4);
+    pchecksum = (uint32_t *)((void *)h + sizeof(*h) + payload - 4);
+    *pchecksum = htonl(checksum);
+
+    slirp_send_packet_all(slirp, ncsi_aen, ETH_HLEN + sizeof(*h) + payload);
+    __atomic_fetch_add(&nc->stats.tx_aen_pkts, 1, __ATOMIC_RELAXED);
+}
+
+void ncsi_aen_raise(Slirp *slirp, unsigned char channel, unsigned char type)
+{
+    struct ncsi_channel_state *nc = ncsi_channel(slirp, channel);
+
+    if (nc) {
+        __atomic_fetch_or(&nc->aen_pending, 1 << type, __ATOMIC_RELAXED);
+        __atomic_store_n(&slirp->state->aen_dirty, 1, __ATOMIC_RELEASE);
+    }
+}
+
+void ncsi_set_link_status(Slirp *slirp, uint32_t status)
+{
+    struct ncsi_state *state = slirp->state;
+    int p, c;
+
+    if (status == slirp->link_status) {
+        return;
+    }
+    __atomic_store_n(&slirp->link_status, status, __ATOMIC_RELAXED);
+
+    /* All channels share the one host link */
+    for (p = 0; p < NCSI_MAX_PACKAGES; p++) {
+        for (c = 0; c < NCSI_RESERVED_CHANNEL; c++) {
+            if (__atomic_load_n(&state->channels[p][c].initialized,
+                                __ATOMIC_RELAXED)) {
+                ncsi_aen_raise(slirp, (p << 5) | c, NCSI_PKT_AEN_LSC);
+            }
+        }
+    }
+    ncsi_aen_flush(slirp);
+}
+
+void ncsi_aen_flush(Slirp *slirp)
+{
+    struct ncsi_state *state = slirp->state;
+    struct ncsi_channel_state *nc;
+    uint32_t ready;
+    int p, c, type;
+
+    /*
+     * Commands may be handled on worker threads (see workers.h) while AENs
+     * are only ever flushed from the main loop, so the AEN bits are
+     * updated atomically.
+     */
+    if (!__atomic_exchange_n(&state->aen_dirty, 0, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    for (p = 0; p < NCSI_MAX_PACKAGES; p++) {
+        for (c = 0; c < NCSI_RESERVED_CHANNEL; c++) {
+            nc = &state->channels[p][c];
+            ready = __atomic_load_n(&nc->aen_pending, __ATOMIC_RELAXED) &
+                    __atomic_load_n(&nc->aen_mode, __ATOMIC_RELAXED);
+            if (!ready) {
+                continue;
+            }
+            __atomic_fetch_and(&nc->aen_pending, ~ready, __ATOMIC_RELAXED);
+            for (type = 0; ready; type++, ready >>= 1) {
+                if (ready & 0x1) {
+                    ncsi_send_aen(slirp, (p << 5) | c, nc, type);
+                }
+            }
+        }
+    }
 }
 
 void slirp_send_packet_all(Slirp *slirp, const void *buf, size_t len)
 {
-  if (send(slirp->socket, buf, len, 0) != (ssize_t)len) {
-    perror("send");
+  if (slirp->send_packet) {
+    slirp->send_packet(buf, len, slirp->opaque);
   }
 }
@@ -398,6 +398,34 @@ struct ncsi_rsp_oem_mlx_pkt {
     unsigned char data[]; /* Data */
 } SLIRP_PACKED;
 
+/* Broadcom Command Data */
+struct ncsi_cmd_oem_bcm_pkt {
+    unsigned char ver; /* Payload Version */
+    unsigned char type; /* OEM Command type */
+    __be16 len; /* Payload Length */
+    unsigned char data[]; /* Cmd specific Data */
+} SLIRP_PACKED;
+
+/* Broadcom Response Data */
+struct ncsi_rsp_oem_bcm_pkt {
+    unsigned char ver; /* Payload Version */
+    unsigned char type; /* OEM Command type */
+    __be16 len; /* Payload Length */
+    unsigned char data[]; /* Cmd specific Data */
+} SLIRP_PACKED;
+
+/* Intel Command Data */
+struct ncsi_cmd_oem_intel_pkt {
+    unsigned char cmd; /* OEM Command ID */
+    unsigned char data[]; /* Cmd specific Data */
+} SLIRP_PACKED;
+
+/* Intel Response Data */
+struct ncsi_rsp_oem_intel_pkt {
+    unsigned char cmd; /* OEM Command ID */
+    unsigned char data[]; /* Cmd specific Data */
+} SLIRP_PACKED;
+
 /* NCSI packet revision */
 #define NCSI_PKT_REVISION 0x01
 
@@ -495,18 +523,201 @@ struct ncsi_rsp_oem_mlx_pkt {
 #define NCSI_OEM_MLX_CMD_SMAF 0x01 /* CMD ID for Set MC Affinity */
 #define NCSI_OEM_MLX_CMD_SMAF_PARAM 0x07 /* Parameter for SMAF */
 
+/* Broadcom specific OEM Command */
+#define NCSI_OEM_BCM_CMD_GMA 0x01 /* CMD ID for Get MAC */
+
+/* Intel specific OEM Command */
+#define NCSI_OEM_INTEL_CMD_GMA 0x06 /* CMD ID for Get MAC */
+#define NCSI_OEM_INTEL_CMD_KEEP_PHY 0x20 /* CMD ID for Keep PHY up */
+
 /* Mac address offset in OEM response */
+#define BCM_MAC_ADDR_OFFSET 28
 #define MLX_MAC_ADDR_OFFSET 8
+#define INTEL_MAC_ADDR_OFFSET 1
+
+/* Channel byte in the NCSI header: package in bits 7:5, channel in 4:0 */
+#define NCSI_MAX_PACKAGES 8
+#define NCSI_MAX_CHANNELS 32
+#define NCSI_PACKAGE_INDEX(c) (((c) >> 5) & 0x7)
+#define NCSI_CHANNEL_INDEX(c) ((c) & 0x1f)
+#define NCSI_RESERVED_CHANNEL 0x1f /* Package-wide commands */
+
+/* Filter table sizes; mac matches the uc_cnt advertised by GC */
+#define NCSI_MAX_MAC_FILTERS 2
+#define NCSI_MAX_VLAN_FILTERS 8
+
+/* Get Link Status: link status word */
+#define NCSI_LINK_UP 0x1
+#define NCSI_LINK_SPEED_SHIFT 1 /* Speed and duplex, bits 4:1 */
+#define NCSI_LINK_10_FD 0x2
+#define NCSI_LINK_100_FD 0x5
+#define NCSI_LINK_1000_FD 0x7
+#define NCSI_LINK_10G 0x8
+#define NCSI_LINK_20G 0x9
+#define NCSI_LINK_25G 0xa
+#define NCSI_LINK_40G 0xb
+#define NCSI_LINK_50G 0xc
+#define NCSI_LINK_100G 0xd
+#define NCSI_LINK_2500_FD 0xe
+
+/* Get Parameters configuration flags */
+#define NCSI_GP_FLAG_BC 0x1 /* Broadcast filter enabled   */
+#define NCSI_GP_FLAG_EC 0x2 /* Channel enabled            */
+#define NCSI_GP_FLAG_TX 0x4 /* Channel network Tx enabled */
+#define NCSI_GP_FLAG_MC 0x8 /* Global MC filter enabled   */
+
+/* NCSI Statistics, as reported by GNS */
+struct ncsi_channel_stats {
+    uint32_t rx_cmds;
+    uint32_t dropped_cmds;
+    uint32_t cmd_type_errs;
+    uint32_t cmd_csum_errs;
+    uint32_t rx_pkts;
+    uint32_t tx_pkts;
+    uint32_t tx_aen_pkts;
+};
+
+/*
+ * Everything the management controller can configure on a channel. All
+ * fields are fixed-width and in host byte order so the whole state can be
+ * snapshotted and mapped back in as-is.
+ */
+struct ncsi_channel_state {
+    uint8_t initialized;    /* Cleared by reset, set by CIS      */
+    uint8_t enabled;        /* EC/DC                             */
+    uint8_t tx_enabled;     /* ECNT/DCNT                         */
+    uint8_t bc_enabled;     /* EBF/DBF                           */
+    uint8_t mc_enabled;     /* EGMF/DGMF                         */
+    uint8_t vlan_mode;      /* EV mode, 0 when disabled          */
+    uint8_t fc_mode;        /* SNFC                              */
+    uint8_t aen_mc_id;      /* AE                                */
+    uint8_t mac_enable;     /* Bitmap of enabled MAC filters     */
+    uint8_t reserved;
+    uint16_t vlan_enable;   /* Bitmap of enabled VLAN filters    */
+    uint16_t vlan[NCSI_MAX_VLAN_FILTERS];
+    uint8_t mac[NCSI_MAX_MAC_FILTERS][ETH_ALEN];
+    uint32_t aen_mode;      /* Bitmap of enabled AEN types       */
+    uint32_t aen_pending;   /* Bitmap of AENs waiting to be sent */
+    uint32_t link_mode;     /* SL                                */
+    uint32_t oem_link_mode;
+    uint32_t bc_mode;       /* EBF                               */
+    uint32_t mc_mode;       /* EGMF                              */
+    struct ncsi_channel_stats stats;
+};
+
+struct ncsi_package_state {
+    uint8_t selected;
+    uint8_t hw_arbitration;
+    uint8_t reserved[2];
+};
+
+struct ncsi_state {
+    uint32_t aen_dirty; /* Some AEN may have become sendable */
+    struct ncsi_package_state packages[NCSI_MAX_PACKAGES];
+    struct ncsi_channel_state channels[NCSI_MAX_PACKAGES][NCSI_MAX_CHANNELS];
+};
 
 typedef struct Slirp Slirp;
 
+typedef int (*ncsi_rsp_handler_fn)(Slirp *slirp, const struct ncsi_pkt_hdr *nh,
+                                   struct ncsi_rsp_pkt_hdr *rnh);
+
+/* An OEM command handler and the shortest command payload it accepts */
+struct ncsi_oem_handler {
+    int cmd_payload;        /* Including the manufacturer ID */
+    ncsi_rsp_handler_fn handler;
+};
+
+/*
+ * What the emulated controller reports about itself in GVI and GC, and how
+ * it answers its vendor's OEM commands. Each vendor lives in its own
+ * ncsi-<vendor>.c with a statically built table of OEM command handlers,
+ * indexed directly by command ID.
+ */
+struct ncsi_personality {
+    uint32_t mfr_id;
+    const char *name;
+    char fw_name[12];       /* GVI firmware name, not NUL-terminated */
+    uint32_t fw_version;
+    uint16_t pci_ids[4];    /* GVI DID, VID, SSID, SSVID */
+    uint32_t cap;           /* GC capabilities */
+    uint32_t bc_cap;
+    uint32_t mc_cap;
+    uint32_t buf_cap;
+    uint32_t aen_cap;
+    uint8_t vlan_mode;
+    uint8_t uc_cnt;
+    /* OEM command dispatch, or NULL if the vendor has no OEM commands */
+    ncsi_rsp_handler_fn oem_handler;
+};
+
+extern const struct ncsi_personality ncsi_personality_mlx;
+extern const struct ncsi_personality ncsi_personality_bcm;
+extern const struct ncsi_personality ncsi_personality_intel;
+
 struct Slirp {
   uint32_t mfr_id;
+  const struct ncsi_personality *personality;
   uint8_t ncsi_mac[ETH_ALEN];
-  int socket;
+  uint32_t link_status; /* GLS link status word, see NCSI_LINK_* */
+  struct ncsi_state *state;
+  /* Transmits a frame built by the emulator, like SlirpCb::send_packet */
+  void (*send_packet)(const void *buf, size_t len, void *opaque);
+  void *opaque;
+  /* Called right around each command handler when set, e.g. to profile it */
+  void (*handler_begin)(void);
+  void (*handler_end)(uint8_t type);
 };
 
+/*
+ * packet format : ncsi header + payload + checksum
+ */
+#define NCSI_MAX_PAYLOAD 172
+#define NCSI_MAX_LEN (sizeof(struct ncsi_pkt_hdr) + NCSI_MAX_PAYLOAD + 4)
+
+/*
+ * Set the manufacturer ID and with it the personality of the controller.
+ * Returns the personality; unknown IDs get a generic one without OEM
+ * commands.
+ */
+const struct ncsi_personality *ncsi_set_mfr_id(Slirp *slirp, uint32_t mfr_id);
+/* Look a personality up by name, e.g. "mlx", or return NULL */
+const struct ncsi_personality *ncsi_find_personality(const char *name);
+/*
+ * Turns the response into Command Unavailable / Invalid Payload Length and
+ * returns -1, for handlers whose command is too short.
+ */
+int ncsi_rsp_length_error(struct ncsi_rsp_pkt_hdr *rnh);
+
+/*
+ * Handle one NC-SI command, without any transport header, and build its
+ * response in rsp, which must hold NCSI_MAX_LEN bytes. Returns the length
+ * of the response including its checksum, or -1 if the command is too
+ * short to handle.
+ */
+int ncsi_process(Slirp *slirp, const uint8_t *cmd, int cmd_len, uint8_t *rsp);
+/*
+ * Handle the command in an Ethernet frame and build the reply frame in
+ * reply, which must hold ETH_HLEN + NCSI_MAX_LEN bytes. Returns the length
+ * of the reply, or -1 if there is none. Nothing is sent and no AENs are
+ * flushed, so this can run away from the thread that owns send_packet.
+ */
+int ncsi_reply(Slirp *slirp, const uint8_t *pkt, int pkt_len, uint8_t *reply);
 void ncsi_input(Slirp *slirp, const uint8_t *pkt, int pkt_len);
+
+/*
+ * Queue an AEN of the given NCSI_PKT_AEN_* type on a channel. It is sent by
+ * ncsi_aen_flush() once the management controller has enabled it.
+ */
+void ncsi_aen_raise(Slirp *slirp, unsigned char channel, unsigned char type);
+void ncsi_aen_flush(Slirp *slirp);
+
+/*
+ * Update the link status reported by GLS and, if it changed, send a Link
+ * State Change AEN on every channel that has it enabled.
+ */
+void ncsi_set_link_status(Slirp *slirp, uint32_t status);
+
 void slirp_send_packet_all(Slirp *slirp, const void *buf, size_t len);
 
 #endif /* NCSI_PKT_H */
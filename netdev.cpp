@@ -0,0 +1,371 @@
+#include "netdev.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <netdb.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+
+// Opens a socket of `type` bound to "unix:PATH" or "HOST:PORT".
+static int BindAddress(const char* address, int type) {
+  if (strncmp(address, "unix:", 5) == 0) {
+    const char* path = address + 5;
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "Socket path is too long\n");
+      return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, type | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+      perror("socket");
+      return -1;
+    }
+    unlink(path);
+    if (bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+      perror("bind");
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  const char* colon = strrchr(address, ':');
+  if (!colon) {
+    fprintf(stderr, "Address must be unix:PATH or HOST:PORT\n");
+    return -1;
+  }
+  // The host may be an IPv6 address in brackets.
+  char host[256];
+  int host_len = int(colon - address);
+  if (host_len >= 2 && address[0] == '[' && address[host_len - 1] == ']') {
+    snprintf(host, sizeof(host), "%.*s", host_len - 2, address + 1);
+  } else {
+    snprintf(host, sizeof(host), "%.*s", host_len, address);
+  }
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = type;
+  hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+  struct addrinfo* res;
+  int err = getaddrinfo(host[0] ? host : nullptr, colon + 1, &hints, &res);
+  if (err != 0) {
+    fprintf(stderr, "%s: %s\n", address, gai_strerror(err));
+    return -1;
+  }
+  int fd = socket(res->ai_family, type | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd == -1) {
+    perror("socket");
+    freeaddrinfo(res);
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(fd, res->ai_addr, res->ai_addrlen) != 0) {
+    perror("bind");
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+static bool IsNcsi(const uint8_t* pkt, size_t len) {
+  return len >= ETH_HLEN && (pkt[12] << 8 | pkt[13]) == ETH_P_NCSI;
+}
+
+StreamNetdev::~StreamNetdev() {
+  Disconnect();
+  if (listen_fd_ != -1) {
+    close(listen_fd_);
+  }
+}
+
+bool StreamNetdev::Listen(const char* address, int busy_poll_usecs) {
+  int fd = BindAddress(address, SOCK_STREAM);
+  if (fd == -1) {
+    return false;
+  }
+  if (listen(fd, 1) != 0) {
+    perror("listen");
+    close(fd);
+    return false;
+  }
+  listen_fd_ = fd;
+  busy_poll_usecs_ = busy_poll_usecs;
+  return true;
+}
+
+void StreamNetdev::Accept() {
+  int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+  if (fd == -1) {
+    if (errno != EAGAIN) {
+      perror("accept");
+    }
+    return;
+  }
+  // Replies are written a batch at a time already.
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  // A Unix socket's connections don't inherit the listening socket's options.
+  if (busy_poll_usecs_ > 0) {
+    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_usecs_,
+               sizeof(busy_poll_usecs_));
+#ifdef SO_PREFER_BUSY_POLL
+    setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one));
+#endif
+  }
+  conn_fd_ = fd;
+  in_len_ = 0;
+  out_off_ = 0;
+  out_len_ = 0;
+  discard_ = 0;
+  printf("stream netdev connected\n");
+}
+
+void StreamNetdev::Disconnect() {
+  if (conn_fd_ == -1) {
+    return;
+  }
+  close(conn_fd_);
+  conn_fd_ = -1;
+  printf("stream netdev disconnected\n");
+}
+
+void StreamNetdev::OnReadable(Slirp* slirp, LatencyHistogram* wake_to_reply) {
+  if (conn_fd_ == -1) {
+    return;
+  }
+  batching_ = true;
+  // Bounded, so a peer that never stops sending can't keep the main loop
+  // from its signals and other sockets.
+  for (int i = 0; i < kMaxReads; i++) {
+    ssize_t r = recv(conn_fd_, in_ + in_len_, kBufferSize - in_len_,
+                     MSG_DONTWAIT);
+    if (r <= 0) {
+      if (r == 0 || (errno != EAGAIN && errno != EINTR)) {
+        Disconnect();
+      }
+      break;
+    }
+    reads_++;
+    in_len_ += size_t(r);
+    Parse(slirp, MonotonicNanos(), wake_to_reply);
+  }
+  batching_ = false;
+  Flush();
+}
+
+void StreamNetdev::Parse(Slirp* slirp, uint64_t wake_ns,
+                         LatencyHistogram* wake_to_reply) {
+  size_t off = 0;
+  for (;;) {
+    if (discard_ > 0) {
+      size_t n = in_len_ - off < discard_ ? in_len_ - off : discard_;
+      off += n;
+      discard_ -= n;
+      if (discard_ > 0) {
+        break;
+      }
+    }
+    if (in_len_ - off < 4) {
+      break;
+    }
+    uint32_t be_len;
+    memcpy(&be_len, in_ + off, sizeof(be_len));
+    size_t len = ntohl(be_len);
+    if (len > kBufferSize - 4) {
+      // Could never be completed in the buffer: skip it.
+      oversized_++;
+      off += 4;
+      discard_ = len;
+      continue;
+    }
+    if (in_len_ - off - 4 < len) {
+      break;
+    }
+    const uint8_t* pkt = in_ + off + 4;
+    off += 4 + len;
+    frames_++;
+    if (IsNcsi(pkt, len)) {
+      ncsi_input(slirp, pkt, int(len));
+      wake_to_reply->Record(MonotonicNanos() - wake_ns);
+    }
+  }
+  // Keep the start of an incomplete frame for the next read.
+  memmove(in_, in_ + off, in_len_ - off);
+  in_len_ -= off;
+}
+
+void StreamNetdev::SendPacket(const void* buf, size_t len, void* opaque) {
+  static_cast<StreamNetdev*>(opaque)->Send(buf, len);
+}
+
+void StreamNetdev::Send(const void* buf, size_t len) {
+  if (conn_fd_ == -1) {
+    return;
+  }
+  if (out_len_ + 4 + len > kBufferSize) {
+    Flush();
+    // Make room behind what QEMU hasn't taken yet.
+    memmove(out_, out_ + out_off_, out_len_ - out_off_);
+    out_len_ -= out_off_;
+    out_off_ = 0;
+    if (out_len_ + 4 + len > kBufferSize) {
+      // QEMU isn't reading: drop whole frames rather than wait for it.
+      dropped_full_++;
+      return;
+    }
+  }
+  uint32_t be_len = htonl(uint32_t(len));
+  memcpy(out_ + out_len_, &be_len, sizeof(be_len));
+  memcpy(out_ + out_len_ + 4, buf, len);
+  out_len_ += 4 + len;
+  replies_++;
+  if (!batching_) {
+    Flush();
+  }
+}
+
+void StreamNetdev::Flush() {
+  while (out_off_ < out_len_ && conn_fd_ != -1) {
+    ssize_t r = send(conn_fd_, out_ + out_off_, out_len_ - out_off_,
+                     MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (r > 0) {
+      out_off_ += size_t(r);
+    } else if (r < 0 && errno == EAGAIN) {
+      // The rest, maybe part of a frame, goes once the socket has room.
+      return;
+    } else if (r < 0 && errno == EINTR) {
+      continue;
+    } else {
+      perror("send");
+      Disconnect();
+    }
+  }
+  out_off_ = 0;
+  out_len_ = 0;
+}
+
+void StreamNetdev::Print() const {
+  printf("stream: reads=%llu frames=%llu replies=%llu oversized=%llu "
+         "dropped_full=%llu\n",
+         (unsigned long long)reads_, (unsigned long long)frames_,
+         (unsigned long long)replies_, (unsigned long long)oversized_,
+         (unsigned long long)dropped_full_);
+}
+
+DgramNetdev::~DgramNetdev() {
+  if (fd_ != -1) {
+    close(fd_);
+  }
+}
+
+bool DgramNetdev::Bind(const char* address) {
+  fd_ = BindAddress(address, SOCK_DGRAM);
+  return fd_ != -1;
+}
+
+void DgramNetdev::OnReadable(Slirp* slirp, LatencyHistogram* wake_to_reply) {
+  struct mmsghdr msgs[kBatch];
+  struct iovec iovs[kBatch];
+  struct sockaddr_storage addrs[kBatch];
+  for (int i = 0; i < kBatch; i++) {
+    iovs[i] = {in_[i], kFrameSize};
+    msgs[i] = {};
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &addrs[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+  }
+
+  batching_ = true;
+  for (;;) {
+    int n = recvmmsg(fd_, msgs, kBatch, MSG_DONTWAIT, nullptr);
+    if (n <= 0) {
+      break;
+    }
+    reads_++;
+    uint64_t wake = MonotonicNanos();
+    for (int i = 0; i < n; i++) {
+      frames_++;
+      memcpy(&peer_, &addrs[i], msgs[i].msg_hdr.msg_namelen);
+      peer_len_ = msgs[i].msg_hdr.msg_namelen;
+      msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+      size_t len = msgs[i].msg_len;
+      if (len > kFrameSize) {
+        len = kFrameSize;
+      }
+      if (IsNcsi(in_[i], len)) {
+        ncsi_input(slirp, in_[i], int(len));
+        wake_to_reply->Record(MonotonicNanos() - wake);
+      }
+    }
+    Flush();
+    if (n < kBatch) {
+      break;
+    }
+  }
+  batching_ = false;
+}
+
+void DgramNetdev::SendPacket(const void* buf, size_t len, void* opaque) {
+  static_cast<DgramNetdev*>(opaque)->Send(buf, len);
+}
+
+void DgramNetdev::Send(const void* buf, size_t len) {
+  // QEMU doesn't announce itself: wait until it has sent us something.
+  if (peer_len_ == 0) {
+    dropped_no_peer_++;
+    return;
+  }
+  if (out_count_ == kBatch) {
+    Flush();
+  }
+  memcpy(out_[out_count_], buf, len);
+  out_len_[out_count_++] = uint16_t(len);
+  if (!batching_) {
+    Flush();
+  }
+}
+
+void DgramNetdev::Flush() {
+  if (out_count_ == 0) {
+    return;
+  }
+  struct mmsghdr msgs[kBatch];
+  struct iovec iovs[kBatch];
+  for (int i = 0; i < out_count_; i++) {
+    iovs[i] = {out_[i], out_len_[i]};
+    msgs[i] = {};
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &peer_;
+    msgs[i].msg_hdr.msg_namelen = peer_len_;
+  }
+  int sent = sendmmsg(fd_, msgs, unsigned(out_count_), 0);
+  if (sent < 0 && errno != EAGAIN && errno != ENOBUFS) {
+    perror("sendmmsg");
+  }
+  // Like a real link, drop what the peer has no room for rather than
+  // stall: a Unix datagram socket only queues a handful of frames.
+  if (sent < 0) {
+    sent = 0;
+  }
+  replies_ += uint64_t(sent);
+  dropped_full_ += uint64_t(out_count_ - sent);
+  out_count_ = 0;
+}
+
+void DgramNetdev::Print() const {
+  printf("dgram: reads=%llu frames=%llu replies=%llu dropped_no_peer=%llu "
+         "dropped_full=%llu\n",
+         (unsigned long long)reads_, (unsigned long long)frames_,
+         (unsigned long long)replies_, (unsigned long long)dropped_no_peer_,
+         (unsigned long long)dropped_full_);
+}
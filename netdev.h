@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <poll.h>
+#include <sys/socket.h>
+#include <net/ethernet.h>
+
+extern "C" {
+#include "ncsi.h"
+};
+
+#include "latency.h"
+
+// Peers for QEMU's socket netdevs, which connect a BMC without root or a
+// tap. Addresses are "unix:PATH" or "HOST:PORT"; the emulator listens or
+// binds there, and QEMU is pointed at it.
+//
+// Both read in batches and answer a whole batch before sending, and both
+// have the same interface, so the main loop can drive either.
+
+// -netdev stream: frames over a Unix or TCP stream, each preceded by its
+// length as a 4-byte big-endian integer. Frames are handled where they lie
+// in the receive buffer, however many one read brings in; only the start
+// of a frame cut off by the end of a read is moved, to the front of the
+// buffer, to be completed by the next one.
+class StreamNetdev {
+ public:
+  ~StreamNetdev();
+
+  // With `busy_poll_usecs`, QEMU's connection gets SO_BUSY_POLL.
+  bool Listen(const char* address, int busy_poll_usecs);
+  // The listening socket while QEMU isn't connected, else -1.
+  int listen_fd() const { return conn_fd_ == -1 ? listen_fd_ : -1; }
+  int fd() const { return conn_fd_; }
+
+  void Accept();
+  // Reads and answers everything QEMU has sent.
+  void OnReadable(Slirp* slirp, LatencyHistogram* wake_to_reply);
+  // Replies QEMU hasn't taken yet are kept, and new ones are dropped while
+  // the buffer is full, so the main loop never blocks on a stuck peer;
+  // these tell it when to send the rest.
+  short poll_events() const { return out_off_ < out_len_ ? POLLOUT : 0; }
+  void OnWritable() { Flush(); }
+
+  // Matches Slirp::send_packet, with the netdev as the opaque pointer.
+  static void SendPacket(const void* buf, size_t len, void* opaque);
+
+  void Print() const;
+
+ private:
+  static constexpr size_t kBufferSize = 64 * 1024;
+  static constexpr int kMaxReads = 16;
+
+  void Parse(Slirp* slirp, uint64_t wake_ns, LatencyHistogram* wake_to_reply);
+  void Send(const void* buf, size_t len);
+  void Flush();
+  void Disconnect();
+
+  int listen_fd_ = -1;
+  int conn_fd_ = -1;
+  int busy_poll_usecs_ = 0;
+  bool batching_ = false;
+  // Left to skip of a frame too big for the buffer.
+  size_t discard_ = 0;
+  size_t in_len_ = 0;
+  // out_[out_off_, out_len_) is still to be sent.
+  size_t out_off_ = 0;
+  size_t out_len_ = 0;
+  uint8_t in_[kBufferSize];
+  uint8_t out_[kBufferSize];
+
+  uint64_t reads_ = 0;
+  uint64_t frames_ = 0;
+  uint64_t replies_ = 0;
+  uint64_t oversized_ = 0;
+  uint64_t dropped_full_ = 0;
+};
+
+// -netdev dgram: one frame per Unix or UDP datagram. Up to kBatch of them
+// are read with one recvmmsg() and the replies go out with one sendmmsg(),
+// to whoever sent the last frame.
+class DgramNetdev {
+ public:
+  ~DgramNetdev();
+
+  bool Bind(const char* address);
+  int listen_fd() const { return -1; }
+  int fd() const { return fd_; }
+
+  void Accept() {}
+  void OnReadable(Slirp* slirp, LatencyHistogram* wake_to_reply);
+  // Replies the peer has no room for are dropped, never kept.
+  short poll_events() const { return 0; }
+  void OnWritable() {}
+
+  static void SendPacket(const void* buf, size_t len, void* opaque);
+
+  void Print() const;
+
+ private:
+  static constexpr int kBatch = 32;
+  // Longer frames are truncated, which leaves NC-SI commands intact.
+  static constexpr size_t kFrameSize = 1536;
+
+  void Send(const void* buf, size_t len);
+  void Flush();
+
+  int fd_ = -1;
+  struct sockaddr_storage peer_ = {};
+  socklen_t peer_len_ = 0;
+  bool batching_ = false;
+  int out_count_ = 0;
+  uint8_t in_[kBatch][kFrameSize];
+  uint16_t out_len_[kBatch];
+  uint8_t out_[kBatch][ETH_HLEN + NCSI_MAX_LEN];
+
+  uint64_t reads_ = 0;
+  uint64_t frames_ = 0;
+  uint64_t replies_ = 0;
+  uint64_t dropped_no_peer_ = 0;
+  uint64_t dropped_full_ = 0;
+};
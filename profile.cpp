@@ -0,0 +1,205 @@
+#include "profile.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+namespace {
+
+enum { kCycles, kInstructions, kCacheMisses, kBranchMisses, kCounters };
+
+const struct {
+  uint64_t config;
+  const char* name;
+} kEvents[kCounters] = {
+  {PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+  {PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+  {PERF_COUNT_HW_CACHE_MISSES, "cache-misses"},
+  {PERF_COUNT_HW_BRANCH_MISSES, "branch-misses"},
+};
+
+// Written only by the thread that owns it, read by the report.
+struct Totals {
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> counters[kCounters];
+};
+
+struct ThreadProfile {
+  bool ok;
+  int fds[kCounters];
+  volatile struct perf_event_mmap_page* pages[kCounters];
+  uint64_t start[kCounters];
+  Totals totals[256];
+};
+
+constexpr int kMaxThreads = 72;
+std::atomic<ThreadProfile*> g_threads[kMaxThreads];
+std::atomic<int> g_nthreads;
+thread_local ThreadProfile* t_profile;
+
+void Add(std::atomic<uint64_t>* total, uint64_t value) {
+  total->store(total->load(std::memory_order_relaxed) + value,
+               std::memory_order_relaxed);
+}
+
+bool Open(ThreadProfile* p) {
+  for (int i = 0; i < kCounters; i++) {
+    struct perf_event_attr attr = {};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = kEvents[i].config;
+    // The handlers run entirely in user space.
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // One group, so all four count over exactly the same instructions.
+    int group = i == 0 ? -1 : p->fds[0];
+    int fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, group,
+                         PERF_FLAG_FD_CLOEXEC));
+    if (fd == -1) {
+      fprintf(stderr, "perf_event_open(%s): %s\n", kEvents[i].name,
+              strerror(errno));
+      for (int j = 0; j < i; j++) {
+        close(p->fds[j]);
+      }
+      return false;
+    }
+    p->fds[i] = fd;
+    void* page = mmap(nullptr, size_t(sysconf(_SC_PAGESIZE)), PROT_READ,
+                      MAP_SHARED, fd, 0);
+    p->pages[i] = page == MAP_FAILED
+                      ? nullptr
+                      : static_cast<struct perf_event_mmap_page*>(page);
+  }
+  return true;
+}
+
+ThreadProfile* Register() {
+  auto p = new ThreadProfile();
+  int slot = g_nthreads.fetch_add(1);
+  if (slot >= kMaxThreads) {
+    fprintf(stderr, "Too many threads to profile\n");
+    return p;
+  }
+  p->ok = Open(p);
+  g_threads[slot].store(p, std::memory_order_release);
+  return p;
+}
+
+uint64_t ReadCounter(const ThreadProfile* p, int i) {
+#if defined(__x86_64__) || defined(__i386__)
+  // The self-monitoring sequence from perf_event_open(2): the page tells
+  // us which hardware counter the event is on right now, and the lock
+  // changes whenever that does.
+  auto pc = p->pages[i];
+  if (pc && pc->cap_user_rdpmc) {
+    for (;;) {
+      uint32_t seq = pc->lock;
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+      uint32_t index = pc->index;
+      int64_t count = pc->offset;
+      if (index != 0) {
+        uint32_t lo, hi;
+        asm volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(index - 1));
+        int shift = 64 - pc->pmc_width;
+        count += int64_t((uint64_t(hi) << 32 | lo) << shift) >> shift;
+      }
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+      if (pc->lock == seq) {
+        if (index != 0) {
+          return uint64_t(count);
+        }
+        break;
+      }
+    }
+  }
+#endif
+  uint64_t value = 0;
+  if (read(p->fds[i], &value, sizeof(value)) != sizeof(value)) {
+    return 0;
+  }
+  return value;
+}
+
+void HandlerBegin() {
+  ThreadProfile* p = t_profile;
+  if (!p) {
+    p = t_profile = Register();
+  }
+  if (!p->ok) {
+    return;
+  }
+  for (int i = 0; i < kCounters; i++) {
+    p->start[i] = ReadCounter(p, i);
+  }
+}
+
+void HandlerEnd(uint8_t type) {
+  ThreadProfile* p = t_profile;
+  if (!p->ok) {
+    return;
+  }
+  uint64_t end[kCounters];
+  for (int i = 0; i < kCounters; i++) {
+    end[i] = ReadCounter(p, i);
+  }
+  Totals& t = p->totals[type];
+  Add(&t.count, 1);
+  for (int i = 0; i < kCounters; i++) {
+    Add(&t.counters[i], end[i] - p->start[i]);
+  }
+}
+
+}  // namespace
+
+bool EnableHandlerProfiling(Slirp* slirp) {
+  // Open the main thread's counters now, both to fail early and to keep
+  // the system calls away from the first command.
+  t_profile = Register();
+  if (!t_profile->ok) {
+    return false;
+  }
+  slirp->handler_begin = HandlerBegin;
+  slirp->handler_end = HandlerEnd;
+  return true;
+}
+
+void PrintHandlerProfile() {
+  int nthreads = g_nthreads.load();
+  if (nthreads == 0) {
+    return;
+  }
+  if (nthreads > kMaxThreads) {
+    nthreads = kMaxThreads;
+  }
+  for (int type = 0; type < 256; type++) {
+    uint64_t count = 0;
+    uint64_t sum[kCounters] = {};
+    for (int i = 0; i < nthreads; i++) {
+      ThreadProfile* p = g_threads[i].load(std::memory_order_acquire);
+      if (!p) {
+        continue;
+      }
+      const Totals& t = p->totals[type];
+      count += t.count.load(std::memory_order_relaxed);
+      for (int j = 0; j < kCounters; j++) {
+        sum[j] += t.counters[j].load(std::memory_order_relaxed);
+      }
+    }
+    if (count == 0) {
+      continue;
+    }
+    // Per command, so different command types compare directly.
+    printf("profile 0x%02x: n=%llu cycles=%.0f instructions=%.0f ipc=%.2f "
+           "cache-misses=%.2f branch-misses=%.2f\n",
+           type, (unsigned long long)count, double(sum[kCycles]) / count,
+           double(sum[kInstructions]) / count,
+           sum[kCycles] ? double(sum[kInstructions]) / sum[kCycles] : 0.0,
+           double(sum[kCacheMisses]) / count,
+           double(sum[kBranchMisses]) / count);
+  }
+}
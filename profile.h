@@ -0,0 +1,20 @@
+#pragma once
+
+#include <net/ethernet.h>
+
+extern "C" {
+#include "ncsi.h"
+};
+
+// Counts cycles, instructions, cache misses and branch misses around every
+// command handler with perf_event_open(), and aggregates them per command
+// type. The counters are opened per thread, on the first command each
+// thread handles, and read with rdpmc where the kernel allows it, so the
+// measurement itself costs no system calls; otherwise they fall back to
+// read().
+//
+// Returns false if the counters can't be opened, e.g. without a PMU.
+bool EnableHandlerProfiling(Slirp* slirp);
+
+// Prints IPC and misses per command for every command type seen so far.
+void PrintHandlerProfile();
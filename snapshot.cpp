@@ -0,0 +1,126 @@
+#include "snapshot.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static constexpr uint32_t kStateOffset = 4096;
+
+struct SnapshotHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t header_size;
+  uint32_t state_offset;
+  uint32_t state_size;
+  uint32_t mfr_id;
+  uint8_t ncsi_mac[ETH_ALEN];
+  uint8_t reserved[2];
+};
+
+static bool WriteAll(int fd, const void* buf, size_t len) {
+  auto p = static_cast<const uint8_t*>(buf);
+  while (len > 0) {
+    ssize_t r = write(fd, p, len);
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += r;
+    len -= size_t(r);
+  }
+  return true;
+}
+
+bool WriteSnapshot(const Slirp& slirp, int fd) {
+  uint8_t page[kStateOffset] = {};
+  SnapshotHeader hdr = {};
+  hdr.magic = NCSI_SNAPSHOT_MAGIC;
+  hdr.version = NCSI_SNAPSHOT_VERSION;
+  hdr.header_size = sizeof(hdr);
+  hdr.state_offset = kStateOffset;
+  hdr.state_size = sizeof(*slirp.state);
+  hdr.mfr_id = slirp.mfr_id;
+  memcpy(hdr.ncsi_mac, slirp.ncsi_mac, ETH_ALEN);
+  memcpy(page, &hdr, sizeof(hdr));
+  if (!WriteAll(fd, page, sizeof(page)) ||
+      !WriteAll(fd, slirp.state, sizeof(*slirp.state))) {
+    perror("write");
+    return false;
+  }
+  return true;
+}
+
+bool MapSnapshot(Slirp* slirp, int fd) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    perror("fstat");
+    return false;
+  }
+  size_t size = size_t(st.st_size);
+  if (size < kStateOffset + sizeof(*slirp->state)) {
+    fprintf(stderr, "Snapshot is truncated\n");
+    return false;
+  }
+  // Private and writable: the emulator keeps mutating the state in place,
+  // and none of that should end up back in the snapshot.
+  void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (base == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+  auto hdr = static_cast<const SnapshotHeader*>(base);
+  if (hdr->magic != NCSI_SNAPSHOT_MAGIC ||
+      hdr->version != NCSI_SNAPSHOT_VERSION ||
+      hdr->state_offset != kStateOffset ||
+      hdr->state_size != sizeof(*slirp->state)) {
+    fprintf(stderr, "Snapshot has an incompatible format (version %u)\n",
+            hdr->version);
+    munmap(base, size);
+    return false;
+  }
+  ncsi_set_mfr_id(slirp, hdr->mfr_id);
+  memcpy(slirp->ncsi_mac, hdr->ncsi_mac, ETH_ALEN);
+  slirp->state = reinterpret_cast<struct ncsi_state*>(
+      static_cast<uint8_t*>(base) + hdr->state_offset);
+  return true;
+}
+
+bool SaveSnapshot(const Slirp& slirp, const char* path) {
+  std::string tmp = std::string(path) + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    perror("open");
+    return false;
+  }
+  if (!WriteSnapshot(slirp, fd)) {
+    close(fd);
+    unlink(tmp.c_str());
+    return false;
+  }
+  close(fd);
+  if (rename(tmp.c_str(), path) != 0) {
+    perror("rename");
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool RestoreSnapshot(Slirp* slirp, const char* path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    perror("open");
+    return false;
+  }
+  // The mapping stays valid after the fd is closed.
+  bool ok = MapSnapshot(slirp, fd);
+  close(fd);
+  return ok;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+#include <net/ethernet.h>
+
+extern "C" {
+#include "ncsi.h"
+};
+
+// Snapshots are a small header followed by struct ncsi_state exactly as it
+// sits in memory, starting on a page boundary. Restoring maps the file
+// copy-on-write and points the Slirp at it, so bringing back an instance
+// costs a page-in rather than a parse. Bump the version whenever
+// struct ncsi_state changes layout.
+#define NCSI_SNAPSHOT_MAGIC 0x5353434e /* "NCSS" */
+#define NCSI_SNAPSHOT_VERSION 1
+
+bool WriteSnapshot(const Slirp& slirp, int fd);
+bool MapSnapshot(Slirp* slirp, int fd);
+
+// Writes atomically: the snapshot replaces `path` only once complete.
+bool SaveSnapshot(const Slirp& slirp, const char* path);
+bool RestoreSnapshot(Slirp* slirp, const char* path);
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+// Bounded single-producer, single-consumer ring of preallocated slots.
+// The producer fills the slot from Back() and publishes it with Push(); the
+// consumer reads the slot from Front() and releases it with Pop(), so
+// entries are built and consumed in place without copying. N must be a
+// power of two.
+template <typename T, size_t N>
+class SpscRing {
+  static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+
+ public:
+  // Producer side. Returns nullptr when the ring is full.
+  T* Back() {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ == N) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail - cached_head_ == N) {
+        return nullptr;
+      }
+    }
+    return &slots_[tail & (N - 1)];
+  }
+  void Push() {
+    tail_.store(tail_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+  }
+
+  // Consumer side. Returns nullptr when the ring is empty.
+  T* Front() {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == cached_tail_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head == cached_tail_) {
+        return nullptr;
+      }
+    }
+    return &slots_[head & (N - 1)];
+  }
+  void Pop() {
+    head_.store(head_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+  }
+
+ private:
+  // Each side keeps its own index, and a copy of the other's, on its own
+  // cache line so they only share a line when the ring runs full or dry.
+  alignas(64) std::atomic<size_t> head_{0};
+  size_t cached_tail_ = 0;
+  alignas(64) std::atomic<size_t> tail_{0};
+  size_t cached_head_ = 0;
+  alignas(64) T slots_[N];
+};
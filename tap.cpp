@@ -0,0 +1,51 @@
+#include "tap.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <linux/if_tun.h>
+
+TapDevice::~TapDevice() {
+  for (int i = 0; i < queues_; i++) {
+    close(fds_[i]);
+  }
+}
+
+bool TapDevice::Open(const char* ifname, int queues) {
+  if (queues < 1 || queues > kMaxQueues) {
+    fprintf(stderr, "A tap can have between 1 and %d queues\n", kMaxQueues);
+    return false;
+  }
+  struct ifreq ifr = {};
+  if (strlen(ifname) >= sizeof(ifr.ifr_name)) {
+    fprintf(stderr, "Interface name is too long\n");
+    return false;
+  }
+  strcpy(ifr.ifr_name, ifname);
+  ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_MULTI_QUEUE | IFF_VNET_HDR;
+
+  while (queues_ < queues) {
+    int fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC | O_NONBLOCK);
+    if (fd == -1) {
+      perror("open(/dev/net/tun)");
+      return false;
+    }
+    // Each TUNSETIFF on the same name adds a queue.
+    if (ioctl(fd, TUNSETIFF, &ifr) != 0) {
+      perror("ioctl(TUNSETIFF)");
+      close(fd);
+      return false;
+    }
+    int hdr_len = int(kVnetHdrLen);
+    if (ioctl(fd, TUNSETVNETHDRSZ, &hdr_len) != 0) {
+      perror("ioctl(TUNSETVNETHDRSZ)");
+      close(fd);
+      return false;
+    }
+    fds_[queues_++] = fd;
+  }
+  return true;
+}
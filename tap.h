@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+
+// A tap device the emulator owns, opened through /dev/net/tun with
+// IFF_MULTI_QUEUE so that each thread can have its own queue, and with
+// IFF_VNET_HDR so every frame carries virtio-net offload metadata. The
+// emulator is then an endpoint of the link rather than a sniffer on it:
+// it sees exactly the frames sent to the tap, and nothing is copied to a
+// packet socket. Bridge the tap with QEMU's to connect the BMC.
+class TapDevice {
+ public:
+  // struct virtio_net_hdr, whose header doesn't compile as C++.
+  static constexpr size_t kVnetHdrLen = 10;
+  static constexpr int kMaxQueues = 256;
+
+  ~TapDevice();
+
+  // Creates tap `ifname`, or attaches to it if it exists and is
+  // multi-queue, with `queues` non-blocking queues.
+  bool Open(const char* ifname, int queues);
+
+  int queues() const { return queues_; }
+  int fd(int queue) const { return fds_[queue]; }
+
+ private:
+  int fds_[kMaxQueues];
+  int queues_ = 0;
+};
@@ -0,0 +1,168 @@
+#include "timestamp.h"
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <net/ethernet.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+
+extern "C" {
+#include "ncsi.h"
+};
+
+static uint64_t TimespecNanos(const struct timespec& ts) {
+  return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+}
+
+static uint64_t RealtimeNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return TimespecNanos(ts);
+}
+
+// Finds the SCM_TIMESTAMPING control message and returns its software and
+// raw hardware timestamps, either of which may be zero.
+static bool GetTimestamps(const struct msghdr* msg, uint64_t* sw_ns,
+                          uint64_t* hw_ns) {
+  auto m = const_cast<struct msghdr*>(msg);
+  for (auto c = CMSG_FIRSTHDR(m); c; c = CMSG_NXTHDR(m, c)) {
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPING) {
+      struct scm_timestamping tss;
+      memcpy(&tss, CMSG_DATA(c), sizeof(tss));
+      *sw_ns = TimespecNanos(tss.ts[0]);
+      *hw_ns = TimespecNanos(tss.ts[2]);
+      return true;
+    }
+  }
+  return false;
+}
+
+// The key is the full channel byte, package included, and the sequence id
+// of the command. For a reply, it's those of the command it answers.
+static bool GetKey(const uint8_t* pkt, size_t len, uint16_t* key) {
+  if (len < ETH_HLEN + sizeof(struct ncsi_pkt_hdr)) {
+    return false;
+  }
+  auto nh = reinterpret_cast<const struct ncsi_pkt_hdr*>(pkt + ETH_HLEN);
+  uint8_t channel = nh->channel;
+  // Deselect Package goes to the package's reserved channel, but its reply
+  // names channel 0 of the package.
+  if (nh->type == NCSI_PKT_RSP_DP) {
+    channel |= NCSI_RESERVED_CHANNEL;
+  }
+  *key = uint16_t(channel << 8 | nh->id);
+  return true;
+}
+
+void DiscardErrorQueue(int fd) {
+  uint8_t buf[64];
+  uint8_t control[256];
+  for (;;) {
+    struct iovec iov = {buf, sizeof(buf)};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      break;
+    }
+  }
+  // A pending socket error raises POLLERR too; reading it clears it.
+  int err;
+  socklen_t len = sizeof(err);
+  getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+}
+
+bool TurnaroundTracker::Enable(int fd) {
+  // No SOF_TIMESTAMPING_OPT_TSONLY: the error queue hands back the frame
+  // itself, which is what lets us match it to its request.
+  unsigned int flags = SOF_TIMESTAMPING_RX_SOFTWARE |
+                       SOF_TIMESTAMPING_RX_HARDWARE |
+                       SOF_TIMESTAMPING_TX_SOFTWARE |
+                       SOF_TIMESTAMPING_TX_HARDWARE |
+                       SOF_TIMESTAMPING_SOFTWARE |
+                       SOF_TIMESTAMPING_RAW_HARDWARE;
+  if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) != 0) {
+    perror("setsockopt(SO_TIMESTAMPING)");
+    return false;
+  }
+  fd_ = fd;
+  return true;
+}
+
+void TurnaroundTracker::OnReceive(const struct msghdr* msg, const uint8_t* pkt,
+                                  size_t len, uint64_t wake_ns) {
+  uint16_t key;
+  uint64_t sw_ns = 0;
+  uint64_t hw_ns = 0;
+  if (!GetKey(pkt, len, &key) || !GetTimestamps(msg, &sw_ns, &hw_ns)) {
+    return;
+  }
+
+  // The timestamps are CLOCK_REALTIME, so measure how long ago the frame
+  // arrived on that clock and move the wake-up back by the time it has
+  // taken us to get here.
+  if (sw_ns != 0) {
+    uint64_t now = RealtimeNanos();
+    uint64_t since_wake = MonotonicNanos() - wake_ns;
+    if (now - since_wake > sw_ns) {
+      rx_queuing_.Record(now - since_wake - sw_ns);
+    }
+  }
+
+  auto& p = pending_[key];
+  if (p.valid) {
+    unmatched_++;
+  }
+  p = Pending{true, sw_ns, hw_ns};
+}
+
+void TurnaroundTracker::DrainErrorQueue() {
+  if (fd_ == -1) {
+    return;
+  }
+  for (;;) {
+    uint8_t pkt[ETH_HLEN + sizeof(struct ncsi_pkt_hdr)];
+    uint8_t control[256];
+    struct iovec iov = {pkt, sizeof(pkt)};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t r = recvmsg(fd_, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+    if (r < 0) {
+      return;
+    }
+
+    uint16_t key;
+    uint64_t sw_ns = 0;
+    uint64_t hw_ns = 0;
+    if (!GetKey(pkt, size_t(r), &key) || !GetTimestamps(&msg, &sw_ns, &hw_ns)) {
+      continue;
+    }
+    auto& p = pending_[key];
+    if (!p.valid) {
+      continue;
+    }
+    p.valid = false;
+    // Only compare timestamps taken by the same clock.
+    if (p.rx_hw_ns != 0 && hw_ns != 0) {
+      turnaround_.Record(hw_ns - p.rx_hw_ns);
+    } else if (p.rx_sw_ns != 0 && sw_ns != 0) {
+      turnaround_.Record(sw_ns - p.rx_sw_ns);
+    }
+  }
+}
+
+void TurnaroundTracker::Print() const {
+  if (fd_ == -1) {
+    return;
+  }
+  rx_queuing_.Print("rx-queuing");
+  turnaround_.Print("turnaround");
+  printf("turnaround: %llu requests without a reply timestamp\n",
+         (unsigned long long)unmatched_);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <sys/socket.h>
+
+#include "latency.h"
+
+// Empties a socket's error queue, which keeps it readable with POLLERR. It
+// can hold TX timestamps even when we don't ask for them: a predecessor
+// that handed the socket over may have had them enabled.
+void DiscardErrorQueue(int fd);
+
+// Uses SO_TIMESTAMPING on the packet socket to measure how long a command
+// spends between arriving on the interface and its reply leaving it,
+// including kernel queuing on both sides. RX timestamps come with each
+// received frame; TX timestamps are read back from the socket's error
+// queue together with a copy of the reply, and the two are paired up by
+// the NC-SI channel and sequence id. There is a slot for every channel and
+// id, so the tracker is large: keep it off the stack.
+class TurnaroundTracker {
+ public:
+  bool Enable(int fd);
+  bool enabled() const { return fd_ != -1; }
+
+  // Called with the msghdr of every NC-SI command received with recvmsg()
+  // and the monotonic time the emulator woke up for it.
+  void OnReceive(const struct msghdr* msg, const uint8_t* pkt, size_t len,
+                 uint64_t wake_ns);
+  // Reads all pending TX timestamps off the error queue.
+  void DrainErrorQueue();
+
+  void Print() const;
+
+ private:
+  struct Pending {
+    bool valid;
+    uint64_t rx_sw_ns;
+    uint64_t rx_hw_ns;
+  };
+  // Indexed by channel << 8 | id.
+  static constexpr int kPendingSlots = 65536;
+
+  int fd_ = -1;
+  Pending pending_[kPendingSlots] = {};
+  uint64_t unmatched_ = 0;
+  // Interface to wake-up: kernel and socket RX queuing.
+  LatencyHistogram rx_queuing_;
+  // Interface to interface: the full request-to-response turnaround.
+  LatencyHistogram turnaround_;
+};
@@ -0,0 +1,119 @@
+#include "txq.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "latency.h"
+
+void TxQueue::SendPacket(const void* buf, size_t len, void* opaque) {
+  static_cast<TxQueue*>(opaque)->Send(buf, len);
+}
+
+bool TxQueue::TrySend(const void* buf, size_t len) {
+  ssize_t r;
+  if (vnet_hdr_len_ > 0) {
+    // No offloads: an all-zero header says the frame is complete as is.
+    static const uint8_t kNoOffloads[16] = {};
+    struct iovec iov[2] = {
+      {const_cast<uint8_t*>(kNoOffloads), vnet_hdr_len_},
+      {const_cast<void*>(buf), len},
+    };
+    r = writev(fd_, iov, 2);
+    if (r > 0) {
+      r -= ssize_t(vnet_hdr_len_);
+    }
+  } else {
+    r = send(fd_, buf, len, MSG_DONTWAIT);
+  }
+  if (r == ssize_t(len)) {
+    sent_++;
+    backoff_ = false;
+    return true;
+  }
+  if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)) {
+    backoff_ = errno == ENOBUFS;
+    if (backoff_) {
+      backoff_until_ns_ = MonotonicNanos() + kBackoffNs;
+    }
+    return false;
+  }
+  // Anything else won't get better by retrying.
+  perror("send");
+  errors_++;
+  return true;
+}
+
+void TxQueue::Send(const void* buf, size_t len) {
+  // Keep frames in order: nothing jumps the backlog.
+  if (count_ == 0 && TrySend(buf, len)) {
+    return;
+  }
+  if (count_ == kFrames || len > kFrameSize) {
+    dropped_full_++;
+    return;
+  }
+  auto& frame = frames_[(head_ + count_) % kFrames];
+  frame.len = uint16_t(len);
+  frame.retries = 0;
+  memcpy(frame.data, buf, len);
+  count_++;
+  queued_++;
+}
+
+bool TxQueue::Writable() const {
+  if (backoff_) {
+    return MonotonicNanos() >= backoff_until_ns_;
+  }
+  struct pollfd pfd = {fd_, POLLOUT, 0};
+  return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT);
+}
+
+void TxQueue::Flush() {
+  // Without this, a busy-poll loop would use up a frame's retries long
+  // before the device has had a chance to drain.
+  if (count_ > 0 && !Writable()) {
+    return;
+  }
+  while (count_ > 0) {
+    auto& frame = frames_[head_];
+    if (!TrySend(frame.data, frame.len)) {
+      retries_++;
+      if (++frame.retries < kMaxRetries) {
+        return;
+      }
+      dropped_retries_++;
+    }
+    head_ = (head_ + 1) % kFrames;
+    count_--;
+  }
+}
+
+void TxQueue::Drain(int timeout_ms) {
+  uint64_t deadline = MonotonicNanos() + uint64_t(timeout_ms) * 1000000;
+  while (count_ > 0 && MonotonicNanos() < deadline) {
+    struct pollfd pfd = {fd_, poll_events(), 0};
+    poll(&pfd, 1, 1);
+    Flush();
+  }
+}
+
+short TxQueue::poll_events() const {
+  return count_ > 0 && !backoff_ ? POLLOUT : 0;
+}
+
+int TxQueue::poll_timeout_ms() const {
+  return count_ > 0 && backoff_ ? 1 : -1;
+}
+
+void TxQueue::Print() const {
+  printf("tx: sent=%llu queued=%llu retries=%llu dropped_full=%llu "
+         "dropped_retries=%llu errors=%llu backlog=%zu\n",
+         (unsigned long long)sent_, (unsigned long long)queued_,
+         (unsigned long long)retries_, (unsigned long long)dropped_full_,
+         (unsigned long long)dropped_retries_, (unsigned long long)errors_,
+         count_);
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <net/ethernet.h>
+
+extern "C" {
+#include "ncsi.h"
+};
+
+// Non-blocking transmit path for a packet socket or tap queue. Frames go
+// straight to the fd while it keeps up; when it doesn't, they are copied into a
+// fixed pool of frame buffers and sent from there once the socket is
+// writable again. Nothing is allocated per frame: when the pool is full,
+// or a frame has been retried too often, it is dropped and counted.
+class TxQueue {
+ public:
+  // For a tap opened with IFF_VNET_HDR, `vnet_hdr_len` is the size of the
+  // virtio-net header to put in front of each frame.
+  explicit TxQueue(int fd, size_t vnet_hdr_len = 0)
+      : fd_(fd), vnet_hdr_len_(vnet_hdr_len) {}
+
+  // Matches Slirp::send_packet, with the TxQueue as the opaque pointer.
+  static void SendPacket(const void* buf, size_t len, void* opaque);
+
+  void Send(const void* buf, size_t len);
+  // Sends as much of the backlog as the socket will take. Safe to call on
+  // every spin of a busy-poll loop: the head frame is only retried once
+  // the socket is writable again, or the ENOBUFS back-off has run out.
+  void Flush();
+
+  // Keeps flushing until the backlog is empty or `timeout_ms` has passed.
+  void Drain(int timeout_ms);
+
+  bool pending() const { return count_ > 0; }
+  size_t backlog() const { return count_; }
+  // What to wait for before calling Flush() again: POLLOUT when the socket
+  // buffer was full, or a short timeout when the device queue was (there
+  // is no readiness event for ENOBUFS).
+  short poll_events() const;
+  int poll_timeout_ms() const;
+
+  void Print() const;
+
+ private:
+  static constexpr size_t kFrames = 256;
+  static constexpr size_t kFrameSize = (ETH_HLEN + NCSI_MAX_LEN + 63) & ~63;
+  static constexpr int kMaxRetries = 8;
+
+  struct Frame {
+    uint16_t len;
+    uint8_t retries;
+    uint8_t data[kFrameSize];
+  };
+
+  static constexpr uint64_t kBackoffNs = 1000000;
+
+  // Returns true if the frame is done with, sent or not.
+  bool TrySend(const void* buf, size_t len);
+  // Whether a retry now stands a chance of getting through.
+  bool Writable() const;
+
+  int fd_;
+  size_t vnet_hdr_len_;
+  Frame frames_[kFrames];
+  size_t head_ = 0;
+  size_t count_ = 0;
+  bool backoff_ = false;
+  uint64_t backoff_until_ns_ = 0;
+
+  uint64_t sent_ = 0;
+  uint64_t queued_ = 0;
+  uint64_t retries_ = 0;
+  uint64_t dropped_full_ = 0;
+  uint64_t dropped_retries_ = 0;
+  uint64_t errors_ = 0;
+};
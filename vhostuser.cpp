@@ -0,0 +1,667 @@
+#include "vhostuser.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// The protocol is QEMU's docs/interop/vhost-user.rst. Its constants and the
+// virtio ring layout are spelled out here because the kernel's
+// <linux/virtio_ring.h> doesn't compile as C++.
+#define VHOST_USER_VERSION 0x1
+#define VHOST_USER_REPLY 0x4
+#define VHOST_USER_NEED_REPLY 0x8
+
+#define VHOST_USER_VRING_INDEX_MASK 0xff
+#define VHOST_USER_VRING_NOFD 0x100
+
+#define VHOST_USER_F_PROTOCOL_FEATURES (1ULL << 30)
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK (1ULL << 3)
+#define VIRTIO_NET_F_MRG_RXBUF (1ULL << 15)
+#define VIRTIO_F_VERSION_1 (1ULL << 32)
+
+#define VRING_DESC_F_NEXT 1
+#define VRING_DESC_F_WRITE 2
+#define VRING_DESC_F_INDIRECT 4
+#define VRING_USED_F_NO_NOTIFY 1
+#define VRING_AVAIL_F_NO_INTERRUPT 1
+
+enum VhostUserRequest {
+  kGetFeatures = 1,
+  kSetFeatures = 2,
+  kSetOwner = 3,
+  kResetOwner = 4,
+  kSetMemTable = 5,
+  kSetVringNum = 8,
+  kSetVringAddr = 9,
+  kSetVringBase = 10,
+  kGetVringBase = 11,
+  kSetVringKick = 12,
+  kSetVringCall = 13,
+  kSetVringErr = 14,
+  kGetProtocolFeatures = 15,
+  kSetProtocolFeatures = 16,
+  kSetVringEnable = 18,
+};
+
+struct VhostUserMemoryRegion {
+  uint64_t guest_phys_addr;
+  uint64_t memory_size;
+  uint64_t userspace_addr;
+  uint64_t mmap_offset;
+};
+
+struct VhostUserVringState {
+  uint32_t index;
+  uint32_t num;
+};
+
+struct VhostUserVringAddr {
+  uint32_t index;
+  uint32_t flags;
+  uint64_t desc_user_addr;
+  uint64_t used_user_addr;
+  uint64_t avail_user_addr;
+  uint64_t log_guest_addr;
+};
+
+struct VhostUserMsg {
+  uint32_t request;
+  uint32_t flags;
+  uint32_t size;
+  union {
+    uint64_t u64;
+    VhostUserVringState state;
+    VhostUserVringAddr addr;
+    struct {
+      uint32_t nregions;
+      uint32_t padding;
+      VhostUserMemoryRegion regions[8];
+    } memory;
+  } payload;
+} __attribute__((packed));
+
+static constexpr size_t kMsgHeaderSize = offsetof(VhostUserMsg, payload);
+
+// Split virtqueue, little-endian as virtio 1.0 has it.
+struct VringDesc {
+  uint64_t addr;
+  uint32_t len;
+  uint16_t flags;
+  uint16_t next;
+};
+
+struct VringAvail {
+  uint16_t flags;
+  uint16_t idx;
+  uint16_t ring[];
+};
+
+// The guest can rewrite its rings while we look at them, so every field is
+// loaded exactly once, and only that copy is checked and then used.
+static VringDesc LoadDesc(const VringDesc* desc) {
+  VringDesc d;
+  d.addr = __atomic_load_n(&desc->addr, __ATOMIC_RELAXED);
+  d.len = __atomic_load_n(&desc->len, __ATOMIC_RELAXED);
+  d.flags = __atomic_load_n(&desc->flags, __ATOMIC_RELAXED);
+  d.next = __atomic_load_n(&desc->next, __ATOMIC_RELAXED);
+  return d;
+}
+
+static uint16_t LoadAvailHead(const VringAvail* avail, uint16_t idx,
+                              unsigned int num) {
+  return __atomic_load_n(&avail->ring[idx & (num - 1)], __ATOMIC_RELAXED);
+}
+
+struct VringUsedElem {
+  uint32_t id;
+  uint32_t len;
+};
+
+struct VringUsed {
+  uint16_t flags;
+  uint16_t idx;
+  VringUsedElem ring[];
+};
+
+static constexpr uint64_t kFeatures =
+    VIRTIO_F_VERSION_1 | VHOST_USER_F_PROTOCOL_FEATURES;
+static constexpr uint64_t kProtocolFeatures = VHOST_USER_PROTOCOL_F_REPLY_ACK;
+
+VhostUserBackend::~VhostUserBackend() {
+  Disconnect();
+  if (listen_fd_ != -1) {
+    close(listen_fd_);
+  }
+}
+
+bool VhostUserBackend::Listen(const char* path) {
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "vhost-user socket path is too long\n");
+    return false;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    perror("socket");
+    return false;
+  }
+  unlink(path);
+  if (bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0 ||
+      listen(fd, 1) != 0) {
+    perror("bind");
+    close(fd);
+    return false;
+  }
+  listen_fd_ = fd;
+  return true;
+}
+
+void VhostUserBackend::Accept() {
+  int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+  if (fd == -1) {
+    perror("accept");
+    return;
+  }
+  conn_fd_ = fd;
+  printf("vhost-user frontend connected\n");
+}
+
+void VhostUserBackend::Disconnect() {
+  if (conn_fd_ == -1) {
+    return;
+  }
+  close(conn_fd_);
+  conn_fd_ = -1;
+  ResetRing(&rings_[kRx]);
+  ResetRing(&rings_[kTx]);
+  UnmapMemory();
+  features_ = 0;
+  protocol_features_ = 0;
+  printf("vhost-user frontend disconnected\n");
+}
+
+void VhostUserBackend::UnmapMemory() {
+  for (int i = 0; i < nregions_; i++) {
+    munmap(regions_[i].mmap_addr, regions_[i].mmap_size);
+  }
+  nregions_ = 0;
+}
+
+void VhostUserBackend::ResetRing(Vring* vr) {
+  if (vr->kick_fd != -1) {
+    close(vr->kick_fd);
+  }
+  if (vr->call_fd != -1) {
+    close(vr->call_fd);
+  }
+  *vr = Vring{};
+}
+
+bool VhostUserBackend::MapRing(Vring* vr) {
+  if (vr->desc_addr == 0) {
+    return true;
+  }
+  vr->desc = reinterpret_cast<VringDesc*>(QemuToVa(vr->desc_addr));
+  vr->avail = reinterpret_cast<VringAvail*>(QemuToVa(vr->avail_addr));
+  vr->used = reinterpret_cast<VringUsed*>(QemuToVa(vr->used_addr));
+  return vr->desc && vr->avail && vr->used;
+}
+
+bool VhostUserBackend::Running(const Vring& vr) const {
+  return vr.enabled && vr.num > 0 && vr.desc && vr.avail && vr.used;
+}
+
+int VhostUserBackend::kick_fd() const {
+  const Vring& tx = rings_[kTx];
+  return Running(tx) ? tx.kick_fd : -1;
+}
+
+uint8_t* VhostUserBackend::GuestToVa(uint64_t gpa, uint64_t len) const {
+  for (int i = 0; i < nregions_; i++) {
+    const Region& r = regions_[i];
+    if (gpa >= r.guest_phys_addr && len <= r.size &&
+        gpa - r.guest_phys_addr <= r.size - len) {
+      return r.addr + (gpa - r.guest_phys_addr);
+    }
+  }
+  return nullptr;
+}
+
+uint8_t* VhostUserBackend::QemuToVa(uint64_t qva) const {
+  for (int i = 0; i < nregions_; i++) {
+    const Region& r = regions_[i];
+    if (qva >= r.qemu_addr && qva - r.qemu_addr < r.size) {
+      return r.addr + (qva - r.qemu_addr);
+    }
+  }
+  return nullptr;
+}
+
+void VhostUserBackend::OnControlReadable() {
+  VhostUserMsg msg;
+  alignas(struct cmsghdr) uint8_t control[CMSG_SPACE(kMaxRegions * sizeof(int))];
+  struct iovec iov = {&msg, kMsgHeaderSize};
+  struct msghdr mh = {};
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = control;
+  mh.msg_controllen = sizeof(control);
+  ssize_t r = recvmsg(conn_fd_, &mh, MSG_CMSG_CLOEXEC);
+
+  int fds[kMaxRegions];
+  int nfds = 0;
+  for (auto c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c)) {
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+      nfds = int((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+      memcpy(fds, CMSG_DATA(c), nfds * sizeof(int));
+    }
+  }
+
+  bool ok = r == ssize_t(kMsgHeaderSize) && msg.size <= sizeof(msg.payload);
+  if (ok && msg.size > 0) {
+    ok = recv(conn_fd_, &msg.payload, msg.size, MSG_WAITALL) ==
+         ssize_t(msg.size);
+  }
+  if (ok) {
+    ok = HandleMessage(&msg, fds, nfds);
+  } else if (r != 0) {
+    fprintf(stderr, "Bad vhost-user message\n");
+  }
+  // Whatever fds the message didn't take.
+  for (int i = 0; i < nfds; i++) {
+    if (fds[i] != -1) {
+      close(fds[i]);
+    }
+  }
+  if (!ok) {
+    Disconnect();
+  }
+}
+
+void VhostUserBackend::Reply(VhostUserMsg* msg, uint32_t size) {
+  msg->flags = VHOST_USER_VERSION | VHOST_USER_REPLY;
+  msg->size = size;
+  if (send(conn_fd_, msg, kMsgHeaderSize + size, MSG_NOSIGNAL) !=
+      ssize_t(kMsgHeaderSize + size)) {
+    perror("send");
+  }
+}
+
+bool VhostUserBackend::HandleMessage(VhostUserMsg* msg, int* fds, int nfds) {
+  bool need_reply = (msg->flags & VHOST_USER_NEED_REPLY) &&
+                    (protocol_features_ & VHOST_USER_PROTOCOL_F_REPLY_ACK);
+  Vring* vr = nullptr;
+  uint32_t index = msg->payload.state.index;
+  switch (msg->request) {
+    case kSetVringNum:
+    case kSetVringAddr:
+    case kSetVringBase:
+    case kGetVringBase:
+    case kSetVringEnable:
+      break;
+    case kSetVringKick:
+    case kSetVringCall:
+    case kSetVringErr:
+      index = uint32_t(msg->payload.u64 & VHOST_USER_VRING_INDEX_MASK);
+      break;
+    default:
+      index = 0;
+      break;
+  }
+  if (index > kTx) {
+    fprintf(stderr, "vhost-user: only one queue pair is supported\n");
+    return false;
+  }
+  vr = &rings_[index];
+
+  bool ok = true;
+  switch (msg->request) {
+    case kGetFeatures:
+      msg->payload.u64 = kFeatures;
+      Reply(msg, sizeof(msg->payload.u64));
+      return true;
+    case kSetFeatures:
+      features_ = msg->payload.u64 & kFeatures;
+      // The header grows num_buffers with either feature.
+      hdr_len_ = features_ & (VIRTIO_F_VERSION_1 | VIRTIO_NET_F_MRG_RXBUF)
+                     ? 12
+                     : 10;
+      break;
+    case kGetProtocolFeatures:
+      msg->payload.u64 = kProtocolFeatures;
+      Reply(msg, sizeof(msg->payload.u64));
+      return true;
+    case kSetProtocolFeatures:
+      protocol_features_ = msg->payload.u64 & kProtocolFeatures;
+      break;
+    case kSetOwner:
+    case kResetOwner:
+      break;
+    case kSetMemTable: {
+      uint32_t n = msg->payload.memory.nregions;
+      if (n > kMaxRegions || int(n) != nfds) {
+        fprintf(stderr, "vhost-user: bad memory table\n");
+        ok = false;
+        break;
+      }
+      UnmapMemory();
+      for (uint32_t i = 0; i < n; i++) {
+        const auto& m = msg->payload.memory.regions[i];
+        size_t size = m.memory_size + m.mmap_offset;
+        void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          fds[i], 0);
+        if (addr == MAP_FAILED) {
+          perror("mmap");
+          ok = false;
+          break;
+        }
+        auto base = static_cast<uint8_t*>(addr);
+        regions_[nregions_++] = Region{m.guest_phys_addr, m.memory_size,
+                                       m.userspace_addr, base, size,
+                                       base + m.mmap_offset};
+      }
+      // The mappings keep the memory; the fds aren't needed.
+      for (int i = 0; i < nfds; i++) {
+        close(fds[i]);
+        fds[i] = -1;
+      }
+      // Rings may have moved with the memory.
+      if (ok && !(MapRing(&rings_[kRx]) && MapRing(&rings_[kTx]))) {
+        ok = false;
+      }
+      break;
+    }
+    case kSetVringNum: {
+      uint32_t num = msg->payload.state.num;
+      if (num == 0 || num > 32768 || (num & (num - 1)) != 0) {
+        ok = false;
+        break;
+      }
+      vr->num = num;
+      break;
+    }
+    case kSetVringAddr:
+      vr->desc_addr = msg->payload.addr.desc_user_addr;
+      vr->avail_addr = msg->payload.addr.avail_user_addr;
+      vr->used_addr = msg->payload.addr.used_user_addr;
+      ok = MapRing(vr);
+      break;
+    case kSetVringBase:
+      vr->last_avail_idx = uint16_t(msg->payload.state.num);
+      break;
+    case kGetVringBase:
+      // Stops the ring until it is started again.
+      vr->enabled = false;
+      if (vr->kick_fd != -1) {
+        close(vr->kick_fd);
+        vr->kick_fd = -1;
+      }
+      msg->payload.state.num = vr->last_avail_idx;
+      Reply(msg, sizeof(msg->payload.state));
+      return true;
+    case kSetVringKick:
+    case kSetVringCall:
+    case kSetVringErr: {
+      int fd = -1;
+      if (!(msg->payload.u64 & VHOST_USER_VRING_NOFD)) {
+        if (nfds != 1) {
+          ok = false;
+          break;
+        }
+        fd = fds[0];
+        fds[0] = -1;
+      }
+      if (msg->request == kSetVringErr) {
+        if (fd != -1) {
+          close(fd);
+        }
+      } else if (msg->request == kSetVringCall) {
+        if (vr->call_fd != -1) {
+          close(vr->call_fd);
+        }
+        vr->call_fd = fd;
+      } else {
+        if (vr->kick_fd != -1) {
+          close(vr->kick_fd);
+        }
+        // We drain it from the main loop and mustn't block on it.
+        if (fd != -1) {
+          fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+        vr->kick_fd = fd;
+        // Without protocol features, the kick starts the ring.
+        if (!(features_ & VHOST_USER_F_PROTOCOL_FEATURES)) {
+          vr->enabled = true;
+        }
+      }
+      break;
+    }
+    case kSetVringEnable:
+      vr->enabled = msg->payload.state.num != 0;
+      break;
+    default:
+      fprintf(stderr, "vhost-user: ignoring request %u\n", msg->request);
+      ok = !need_reply;
+      break;
+  }
+  if (need_reply) {
+    msg->payload.u64 = ok ? 0 : 1;
+    Reply(msg, sizeof(msg->payload.u64));
+    return true;
+  }
+  return ok;
+}
+
+bool VhostUserBackend::CopyTx(uint16_t head, size_t* len) {
+  const Vring& tx = rings_[kTx];
+  size_t skip = hdr_len_;
+  size_t data_len = 0;
+  uint16_t i = head;
+  for (unsigned int n = 0;; n++) {
+    if (i >= tx.num || n == tx.num) {
+      return false;
+    }
+    const VringDesc d = LoadDesc(&tx.desc[i]);
+    uint8_t* va = GuestToVa(d.addr, d.len);
+    if (!va || (d.flags & VRING_DESC_F_INDIRECT)) {
+      return false;
+    }
+    size_t dlen = d.len;
+    if (skip >= dlen) {
+      skip -= dlen;
+    } else {
+      size_t room = sizeof(cmd_) - data_len;
+      size_t n_copy = dlen - skip < room ? dlen - skip : room;
+      memcpy(cmd_ + data_len, va + skip, n_copy);
+      data_len += n_copy;
+      skip = 0;
+    }
+    if (!(d.flags & VRING_DESC_F_NEXT)) {
+      break;
+    }
+    i = d.next;
+  }
+  if (data_len == 0) {
+    return false;
+  }
+  *len = data_len;
+  return true;
+}
+
+bool VhostUserBackend::PeekRx(uint16_t* head) const {
+  const Vring& rx = rings_[kRx];
+  if (!Running(rx)) {
+    return false;
+  }
+  uint16_t avail_idx = __atomic_load_n(&rx.avail->idx, __ATOMIC_ACQUIRE);
+  if (avail_idx == rx.last_avail_idx) {
+    return false;
+  }
+  *head = LoadAvailHead(rx.avail, rx.last_avail_idx, rx.num);
+  return *head < rx.num;
+}
+
+void VhostUserBackend::WriteHeader(uint8_t* hdr) const {
+  memset(hdr, 0, hdr_len_);
+  if (hdr_len_ == 12) {
+    hdr[10] = 1;  // num_buffers
+  }
+}
+
+void VhostUserBackend::PushUsed(Vring* vr, uint16_t head, uint32_t len) {
+  uint16_t idx = vr->used->idx;
+  vr->used->ring[idx & (vr->num - 1)] = VringUsedElem{head, len};
+  __atomic_store_n(&vr->used->idx, uint16_t(idx + 1), __ATOMIC_RELEASE);
+  vr->needs_call = true;
+}
+
+void VhostUserBackend::Notify(Vring* vr) {
+  if (!vr->needs_call) {
+    return;
+  }
+  vr->needs_call = false;
+  // The used index has to be visible before we look at the guest's flags.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (vr->call_fd == -1 ||
+      (__atomic_load_n(&vr->avail->flags, __ATOMIC_RELAXED) &
+       VRING_AVAIL_F_NO_INTERRUPT)) {
+    return;
+  }
+  uint64_t one = 1;
+  if (write(vr->call_fd, &one, sizeof(one)) != sizeof(one)) {
+    perror("write(call)");
+  }
+}
+
+void VhostUserBackend::HandleFrame(Slirp* slirp, const uint8_t* pkt,
+                                   size_t len) {
+  if (len < ETH_HLEN || (pkt[12] << 8 | pkt[13]) != ETH_P_NCSI) {
+    return;
+  }
+  commands_++;
+  // The reply is built in our own buffer and copied in by Send(): the
+  // guest can write to its receive buffers while the reply is put together.
+  ncsi_input(slirp, pkt, int(len));
+}
+
+void VhostUserBackend::ProcessTx(Slirp* slirp, bool spin,
+                                 LatencyHistogram* wake_to_reply) {
+  Vring* tx = &rings_[kTx];
+  if (!Running(*tx)) {
+    return;
+  }
+  if (tx->kick_fd != -1 && !spin) {
+    uint64_t kicks;
+    if (read(tx->kick_fd, &kicks, sizeof(kicks)) < 0 && errno != EAGAIN) {
+      perror("read(kick)");
+    }
+  }
+  tx->used->flags = spin ? VRING_USED_F_NO_NOTIFY : 0;
+
+  batching_ = true;
+  for (;;) {
+    uint16_t avail_idx = __atomic_load_n(&tx->avail->idx, __ATOMIC_ACQUIRE);
+    if (avail_idx == tx->last_avail_idx) {
+      break;
+    }
+    uint64_t wake = MonotonicNanos();
+    uint16_t head = LoadAvailHead(tx->avail, tx->last_avail_idx, tx->num);
+    tx->last_avail_idx++;
+    size_t len;
+    if (CopyTx(head, &len)) {
+      HandleFrame(slirp, cmd_, len);
+      wake_to_reply->Record(MonotonicNanos() - wake);
+    } else {
+      bad_descriptors_++;
+    }
+    PushUsed(tx, head, 0);
+  }
+  batching_ = false;
+  Notify(&rings_[kRx]);
+  Notify(tx);
+}
+
+void VhostUserBackend::SendPacket(const void* buf, size_t len, void* opaque) {
+  static_cast<VhostUserBackend*>(opaque)->Send(buf, len);
+}
+
+void VhostUserBackend::Send(const void* buf, size_t len) {
+  Vring* rx = &rings_[kRx];
+  uint16_t head;
+  if (!PeekRx(&head)) {
+    dropped_no_buffer_++;
+    return;
+  }
+  rx->last_avail_idx++;
+
+  uint8_t hdr[12];
+  WriteHeader(hdr);
+  const struct {
+    const uint8_t* data;
+    size_t len;
+  } parts[2] = {
+    {hdr, hdr_len_},
+    {static_cast<const uint8_t*>(buf), len},
+  };
+  int part = 0;
+  size_t part_off = 0;
+  size_t written = 0;
+  uint16_t i = head;
+  for (unsigned int n = 0; part < 2; n++) {
+    if (i >= rx->num || n == rx->num) {
+      break;
+    }
+    const VringDesc d = LoadDesc(&rx->desc[i]);
+    uint8_t* va = GuestToVa(d.addr, d.len);
+    if (!va || !(d.flags & VRING_DESC_F_WRITE)) {
+      break;
+    }
+    size_t off = 0;
+    while (part < 2 && off < d.len) {
+      size_t n_copy = parts[part].len - part_off;
+      if (n_copy > d.len - off) {
+        n_copy = d.len - off;
+      }
+      memcpy(va + off, parts[part].data + part_off, n_copy);
+      off += n_copy;
+      part_off += n_copy;
+      written += n_copy;
+      if (part_off == parts[part].len) {
+        part++;
+        part_off = 0;
+      }
+    }
+    if (!(d.flags & VRING_DESC_F_NEXT)) {
+      break;
+    }
+    i = d.next;
+  }
+  if (part < 2) {
+    // Too small or broken: hand the buffer back empty.
+    bad_descriptors_++;
+    written = 0;
+  } else {
+    replies_++;
+  }
+  PushUsed(rx, head, uint32_t(written));
+  if (!batching_) {
+    Notify(rx);
+  }
+}
+
+void VhostUserBackend::Print() const {
+  printf("vhost-user: commands=%llu replies=%llu "
+         "dropped_no_buffer=%llu bad_descriptors=%llu\n",
+         (unsigned long long)commands_, (unsigned long long)replies_,
+         (unsigned long long)dropped_no_buffer_,
+         (unsigned long long)bad_descriptors_);
+}
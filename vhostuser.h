@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <net/ethernet.h>
+
+extern "C" {
+#include "ncsi.h"
+};
+
+#include "latency.h"
+
+struct VhostUserMsg;
+struct VringDesc;
+struct VringAvail;
+struct VringUsed;
+
+// A vhost-user-net device backend: QEMU connects to our Unix socket
+// (-netdev vhost-user), shares guest memory with us and hands over its
+// virtqueues, so frames never pass through the kernel and no root or tap
+// is needed. The guest can change its buffers at any time, so commands are
+// copied out before they are handled, and replies are built in our own
+// buffer and then copied into a receive buffer.
+//
+// One queue pair, split rings, no indirect descriptors or event index.
+class VhostUserBackend {
+ public:
+  ~VhostUserBackend();
+
+  bool Listen(const char* path);
+  // The listening socket while no frontend is connected, else -1.
+  int listen_fd() const { return conn_fd_ == -1 ? listen_fd_ : -1; }
+  int conn_fd() const { return conn_fd_; }
+  // The guest's TX kick eventfd, once the queue is running.
+  int kick_fd() const;
+
+  void Accept();
+  // Handles one message from the frontend. On an error or a hang-up, drops
+  // the connection and goes back to listening.
+  void OnControlReadable();
+
+  // Answers everything the guest has queued for transmission. With `spin`,
+  // the guest is told not to kick us, as we look for frames anyway.
+  void ProcessTx(Slirp* slirp, bool spin, LatencyHistogram* wake_to_reply);
+
+  // Matches Slirp::send_packet, with the backend as the opaque pointer.
+  static void SendPacket(const void* buf, size_t len, void* opaque);
+
+  void Print() const;
+
+ private:
+  static constexpr int kMaxRegions = 8;
+  static constexpr int kRx = 0;
+  static constexpr int kTx = 1;
+
+  struct Region {
+    uint64_t guest_phys_addr;
+    uint64_t size;
+    uint64_t qemu_addr;
+    uint8_t* mmap_addr;
+    size_t mmap_size;
+    uint8_t* addr;
+  };
+
+  struct Vring {
+    unsigned int num = 0;
+    // As QEMU sees them, and translated.
+    uint64_t desc_addr = 0;
+    uint64_t avail_addr = 0;
+    uint64_t used_addr = 0;
+    VringDesc* desc = nullptr;
+    VringAvail* avail = nullptr;
+    VringUsed* used = nullptr;
+    uint16_t last_avail_idx = 0;
+    int kick_fd = -1;
+    int call_fd = -1;
+    bool enabled = false;
+    bool needs_call = false;
+  };
+
+  bool HandleMessage(VhostUserMsg* msg, int* fds, int nfds);
+  void Reply(VhostUserMsg* msg, uint32_t size);
+  void Disconnect();
+  void UnmapMemory();
+  void ResetRing(Vring* vr);
+  bool MapRing(Vring* vr);
+  bool Running(const Vring& vr) const;
+
+  uint8_t* GuestToVa(uint64_t gpa, uint64_t len) const;
+  uint8_t* QemuToVa(uint64_t qva) const;
+
+  // Copies the frame in a chain from the guest into cmd_, truncated to
+  // its size, which leaves any NC-SI command intact.
+  bool CopyTx(uint16_t head, size_t* len);
+  void HandleFrame(Slirp* slirp, const uint8_t* pkt, size_t len);
+  // Looks at the next receive buffer chain, if the guest has one queued.
+  bool PeekRx(uint16_t* head) const;
+  void WriteHeader(uint8_t* hdr) const;
+  void PushUsed(Vring* vr, uint16_t head, uint32_t len);
+  void Notify(Vring* vr);
+  void Send(const void* buf, size_t len);
+
+  int listen_fd_ = -1;
+  int conn_fd_ = -1;
+  uint64_t features_ = 0;
+  uint64_t protocol_features_ = 0;
+  size_t hdr_len_ = 10;
+  Region regions_[kMaxRegions] = {};
+  int nregions_ = 0;
+  Vring rings_[2];
+  // Notifications are held back while a batch of commands is processed.
+  bool batching_ = false;
+
+  // The command being handled, out of the guest's reach.
+  uint8_t cmd_[ETH_HLEN + NCSI_MAX_LEN];
+
+  uint64_t commands_ = 0;
+  uint64_t replies_ = 0;
+  uint64_t dropped_no_buffer_ = 0;
+  uint64_t bad_descriptors_ = 0;
+};
@@ -0,0 +1,219 @@
+#include "workers.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+static void Signal(int fd) {
+  uint64_t one = 1;
+  if (write(fd, &one, sizeof(one)) != sizeof(one)) {
+    perror("write(eventfd)");
+  }
+}
+
+static void Wait(int fd, int timeout_ms) {
+  if (timeout_ms >= 0) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+      return;
+    }
+  }
+  uint64_t value;
+  if (read(fd, &value, sizeof(value)) < 0 && errno != EAGAIN &&
+      errno != EINTR) {
+    perror("read(eventfd)");
+  }
+}
+
+bool WorkerPool::Start(Slirp* slirp, int count, int first_cpu, bool spin,
+                       TxQueue* const* txqs) {
+  if (count < 1 || count > kMaxWorkers) {
+    fprintf(stderr, "Number of workers must be between 1 and %d\n",
+            kMaxWorkers);
+    return false;
+  }
+  slirp_ = slirp;
+  spin_ = spin;
+  reply_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (reply_fd_ == -1) {
+    perror("eventfd");
+    return false;
+  }
+  workers_.reset(new Worker[count]);
+  for (int i = 0; i < count; i++) {
+    Worker* w = &workers_[i];
+    w->txq = txqs ? txqs[i] : nullptr;
+    w->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (w->wake_fd == -1) {
+      perror("eventfd");
+      return false;
+    }
+    w->thread = std::thread(&WorkerPool::Run, this, w);
+    if (first_cpu >= 0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(first_cpu + i, &set);
+      int err = pthread_setaffinity_np(w->thread.native_handle(), sizeof(set),
+                                       &set);
+      if (err != 0) {
+        fprintf(stderr, "pthread_setaffinity_np: %s\n", strerror(err));
+      }
+    }
+    count_ = i + 1;
+  }
+  return true;
+}
+
+void WorkerPool::Stop() {
+  if (count_ == 0) {
+    return;
+  }
+  stop_.store(true, std::memory_order_seq_cst);
+  for (int i = 0; i < count_; i++) {
+    Signal(workers_[i].wake_fd);
+  }
+  for (int i = 0; i < count_; i++) {
+    workers_[i].thread.join();
+    close(workers_[i].wake_fd);
+  }
+  close(reply_fd_);
+  count_ = 0;
+}
+
+void WorkerPool::Sleep(Worker* w) {
+  // Say we're going to sleep, then look again: Dispatch() either sees the
+  // flag or its command is visible here.
+  w->sleeping.store(true, std::memory_order_seq_cst);
+  if (!w->requests.Front() && !stop_.load(std::memory_order_seq_cst)) {
+    // Wake up now and then to retry a backlog of replies.
+    Wait(w->wake_fd, w->txq && w->txq->pending() ? 1 : -1);
+  }
+  w->sleeping.store(false, std::memory_order_relaxed);
+}
+
+void WorkerPool::Run(Worker* w) {
+  for (;;) {
+    if (w->txq && w->txq->pending()) {
+      w->txq->Flush();
+    }
+    Request* req = w->requests.Front();
+    if (!req) {
+      if (stop_.load(std::memory_order_relaxed)) {
+        return;
+      }
+      if (!spin_) {
+        Sleep(w);
+      }
+      continue;
+    }
+
+    if (w->txq) {
+      uint8_t frame[ETH_HLEN + NCSI_MAX_LEN];
+      int len = ncsi_reply(slirp_, req->pkt, req->len, frame);
+      uint64_t wake_ns = req->wake_ns;
+      w->requests.Pop();
+      if (len > 0) {
+        w->txq->Send(frame, size_t(len));
+        w->wake_to_reply.Record(MonotonicNanos() - wake_ns);
+      }
+      w->handled.fetch_add(1, std::memory_order_release);
+      // AENs still go out from the main loop, which may be asleep.
+      if (!spin_ &&
+          __atomic_load_n(&slirp_->state->aen_dirty, __ATOMIC_ACQUIRE)) {
+        Signal(reply_fd_);
+      }
+      continue;
+    }
+
+    Reply* rep;
+    // The main loop is behind on collecting: let it catch up.
+    while (!(rep = w->replies.Back())) {
+      sched_yield();
+    }
+    rep->wake_ns = req->wake_ns;
+    rep->len = ncsi_reply(slirp_, req->pkt, req->len, rep->frame);
+    w->requests.Pop();
+    w->replies.Push();
+    w->handled.fetch_add(1, std::memory_order_release);
+    if (!spin_) {
+      Signal(reply_fd_);
+    }
+  }
+}
+
+bool WorkerPool::Dispatch(const uint8_t* pkt, size_t len, uint64_t wake_ns) {
+  // Commands too short to have a channel are dropped by ncsi_reply(), on
+  // whichever worker.
+  size_t off = ETH_HLEN + offsetof(struct ncsi_pkt_hdr, channel);
+  unsigned int channel = len > off ? pkt[off] : 0;
+  Worker* w = &workers_[channel % count_];
+
+  Request* req = w->requests.Back();
+  if (!req || len > sizeof(req->pkt)) {
+    w->dropped++;
+    return false;
+  }
+  req->wake_ns = wake_ns;
+  req->len = uint16_t(len);
+  memcpy(req->pkt, pkt, len);
+  w->requests.Push();
+  w->dispatched++;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (w->sleeping.load(std::memory_order_seq_cst)) {
+    Signal(w->wake_fd);
+  }
+  return true;
+}
+
+void WorkerPool::Collect(TxQueue* txq, LatencyHistogram* wake_to_reply) {
+  if (!spin_) {
+    Wait(reply_fd_, -1);
+  }
+  for (int i = 0; i < count_; i++) {
+    Worker* w = &workers_[i];
+    while (Reply* rep = w->replies.Front()) {
+      if (rep->len > 0) {
+        txq->Send(rep->frame, size_t(rep->len));
+        wake_to_reply->Record(MonotonicNanos() - rep->wake_ns);
+      }
+      w->replies.Pop();
+    }
+  }
+  ncsi_aen_flush(slirp_);
+}
+
+void WorkerPool::Quiesce(TxQueue* txq, LatencyHistogram* wake_to_reply) {
+  if (count_ == 0) {
+    return;
+  }
+  for (int i = 0; i < count_; i++) {
+    Worker* w = &workers_[i];
+    while (w->handled.load(std::memory_order_acquire) != w->dispatched) {
+      sched_yield();
+    }
+  }
+  // Every reply is in its ring by now.
+  Collect(txq, wake_to_reply);
+}
+
+void WorkerPool::Print() const {
+  for (int i = 0; i < count_; i++) {
+    const Worker& w = workers_[i];
+    // These belong to a running worker, but a slightly stale or torn
+    // figure is fine for statistics.
+    if (w.txq) {
+      char name[32];
+      snprintf(name, sizeof(name), "worker %d", i);
+      w.wake_to_reply.Print(name);
+      w.txq->Print();
+    }
+    printf("worker %d: commands=%llu dropped=%llu\n", i,
+           (unsigned long long)w.handled.load(std::memory_order_relaxed),
+           (unsigned long long)w.dropped);
+  }
+}
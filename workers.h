@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <net/ethernet.h>
+
+extern "C" {
+#include "ncsi.h"
+};
+
+#include "latency.h"
+#include "spsc.h"
+#include "txq.h"
+
+// Runs commands on a pool of worker threads. The main loop still does all
+// socket I/O: it hands each received command to the worker that owns its
+// (package, channel) and collects the finished reply frames into the TX
+// queue. Commands for one channel always go to the same worker through a
+// single SPSC ring, so they are answered in order, while different
+// channels run in parallel. Workers only build replies; AENs are flushed
+// from the main loop. A backend with a transmit queue per worker can let
+// the workers send their replies themselves instead.
+class WorkerPool {
+ public:
+  WorkerPool() = default;
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+  ~WorkerPool() { Stop(); }
+
+  // Starts `count` workers. With `first_cpu` >= 0, worker i is pinned to
+  // CPU first_cpu + i. With `spin`, idle workers busy-wait instead of
+  // sleeping, and so does the main loop when looking for replies. With
+  // `txqs`, worker i sends its replies through txqs[i], which only it uses.
+  bool Start(Slirp* slirp, int count, int first_cpu, bool spin,
+             TxQueue* const* txqs = nullptr);
+  void Stop();
+
+  bool enabled() const { return count_ > 0; }
+  // Becomes readable when replies are waiting, or, with `txqs`, when a
+  // command has made an AEN sendable (only used without `spin`).
+  int fd() const { return reply_fd_; }
+
+  // Queues a command frame for its channel's worker. Returns false, and
+  // counts a drop, if that worker is too far behind.
+  bool Dispatch(const uint8_t* pkt, size_t len, uint64_t wake_ns);
+  // Moves all finished replies to `txq`, recording how long each took since
+  // its command was read, and flushes any AENs they caused.
+  void Collect(TxQueue* txq, LatencyHistogram* wake_to_reply);
+  // Waits until every dispatched command has been answered, leaving the
+  // state quiet for a snapshot or a hand-off.
+  void Quiesce(TxQueue* txq, LatencyHistogram* wake_to_reply);
+
+  void Print() const;
+
+ private:
+  static constexpr int kMaxWorkers = 64;
+  static constexpr size_t kSlots = 256;
+
+  struct Request {
+    uint64_t wake_ns;
+    uint16_t len;
+    uint8_t pkt[64];
+  };
+  struct Reply {
+    uint64_t wake_ns;
+    int len;
+    uint8_t frame[ETH_HLEN + NCSI_MAX_LEN];
+  };
+  struct Worker {
+    SpscRing<Request, kSlots> requests;
+    SpscRing<Reply, kSlots> replies;
+    int wake_fd = -1;
+    std::atomic<bool> sleeping{false};
+    std::atomic<uint64_t> handled{0};
+    std::thread thread;
+    // Worker only, when it sends its own replies.
+    TxQueue* txq = nullptr;
+    LatencyHistogram wake_to_reply;
+    // Main loop only.
+    uint64_t dispatched = 0;
+    uint64_t dropped = 0;
+  };
+
+  void Run(Worker* w);
+  void Sleep(Worker* w);
+
+  Slirp* slirp_ = nullptr;
+  int count_ = 0;
+  bool spin_ = false;
+  int reply_fd_ = -1;
+  std::atomic<bool> stop_{false};
+  std::unique_ptr<Worker[]> workers_;
+};